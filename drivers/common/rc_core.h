@@ -0,0 +1,255 @@
+#ifndef RC_CORE_H
+#define RC_CORE_H
+
+/*
+ * Gemeinsame Bausteine der RoboCar Treiber: Zeitstempel, Entprellen, ein
+ * Ringpuffer fuer Messwerte und eine per mmap() lesbare Zustandsseite. Alles ist inline, damit die Aufrufe im
+ * Interrupt-Handler nichts kosten und kein weiteres Modul geladen werden muss.
+ */
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/compiler.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/spinlock.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <asm/barrier.h>
+
+/* Zeitstempel aller Treiber: CLOCK_MONOTONIC in ns, wie clock_gettime() im Userspace. */
+static inline u64 rc_now_ns(void)
+{
+	return ktime_get_ns();
+}
+
+/*
+ * Zeitstempel aus dem harten Interrupt. Unter PREEMPT_RT laufen alle mit
+ * request_irq() angemeldeten Handler als Kernel-Thread, rc_now_ns() misst
+ * darin erst, wann der Thread drankommt. rc_request_irq() meldet deshalb
+ * einen primaeren Handler an, der auch unter RT im harten Interrupt laeuft
+ * (IRQF_ONESHOT schliesst das erzwungene Threading aus), nur die Zeit in
+ * stamp ablegt und den eigentlichen Handler als Thread weckt. Der bekommt
+ * stamp als dev und holt die Zeit dort ab. Die Leitung bleibt maskiert, bis
+ * der Thread fertig ist, ein Zeitstempel pro Leitung reicht also.
+ */
+struct rc_irq_stamp {
+	u64 hardirq_ns;
+};
+
+static inline irqreturn_t rc_irq_stamp_handler(int irq, void *dev)
+{
+	struct rc_irq_stamp *stamp = dev;
+
+	stamp->hardirq_ns = rc_now_ns();
+	return IRQ_WAKE_THREAD;
+}
+
+static inline int rc_request_irq(unsigned int irq, irq_handler_t thread_fn,
+	unsigned long flags, const char *name, struct rc_irq_stamp *stamp)
+{
+	return request_threaded_irq(irq, rc_irq_stamp_handler, thread_fn,
+		flags | IRQF_ONESHOT, name, stamp);
+}
+
+/* Wie rc_request_irq(), der Interrupt wird mit dem Geraet freigegeben */
+static inline int rc_devm_request_irq(struct device *dev, unsigned int irq,
+	irq_handler_t thread_fn, unsigned long flags, const char *name,
+	struct rc_irq_stamp *stamp)
+{
+	return devm_request_threaded_irq(dev, irq, rc_irq_stamp_handler, thread_fn,
+		flags | IRQF_ONESHOT, name, stamp);
+}
+
+/* Zeit vom harten Interrupt bis jetzt, fuer die Latenzmessung im Userspace */
+static inline u32 rc_irq_delay_ns(const struct rc_irq_stamp *stamp)
+{
+	return min_t(u64, rc_now_ns() - stamp->hardirq_ns, U32_MAX);
+}
+
+/*
+ * Entprellen einer Flanke. Zwei Varianten:
+ *  - rc_debounce_quiet(): gezaehlt wird nur nach interval_ns Ruhe seit der
+ *    letzten Flanke, auch einer verworfenen (Lichtschranken).
+ *  - rc_debounce_holdoff(): nach einer gezaehlten Flanke werden fuer
+ *    interval_ns alle weiteren verworfen (Taster).
+ */
+struct rc_debounce {
+	u64 interval_ns;
+	u64 last_edge_ns;
+	u64 last_accepted_ns;
+};
+
+static inline void rc_debounce_init(struct rc_debounce *d, u64 interval_ns)
+{
+	d->interval_ns = interval_ns;
+	d->last_edge_ns = 0;
+	d->last_accepted_ns = 0;
+}
+
+static inline bool rc_debounce_quiet(struct rc_debounce *d, u64 now)
+{
+	bool accept = now - d->last_edge_ns > d->interval_ns;
+
+	d->last_edge_ns = now;
+	if (accept)
+		d->last_accepted_ns = now;
+	return accept;
+}
+
+static inline bool rc_debounce_holdoff(struct rc_debounce *d, u64 now)
+{
+	d->last_edge_ns = now;
+	if (d->last_accepted_ns && now - d->last_accepted_ns <= d->interval_ns)
+		return false;
+	d->last_accepted_ns = now;
+	return true;
+}
+
+/*
+ * Ringpuffer fuer Eintraege fester Groesse mit genau einem Schreiber und
+ * genau einem Leser. Beide Seiten kommen ohne Lock aus; mehrere Schreiber
+ * (oder Leser) muessen sich untereinander selbst serialisieren. Ist der
+ * Puffer voll, wird der neue Eintrag verworfen und rc_ring_put() liefert false.
+ * size muss eine Zweierpotenz sein.
+ */
+struct rc_ring {
+	unsigned int head;	/* wird nur vom Schreiber veraendert */
+	unsigned int tail;	/* wird nur vom Leser veraendert */
+	unsigned int mask;
+	size_t esize;
+	void *buffer;
+};
+
+#define DECLARE_RC_RING(name, type, size) \
+	type name##_entries[size]; \
+	struct rc_ring name
+
+#define INIT_RC_RING(name) \
+	rc_ring_init(&(name), (name##_entries), sizeof((name##_entries)[0]), \
+		ARRAY_SIZE(name##_entries))
+
+static inline void rc_ring_init(struct rc_ring *ring, void *buffer, size_t esize,
+	unsigned int size)
+{
+	ring->head = 0;
+	ring->tail = 0;
+	ring->mask = size - 1;
+	ring->esize = esize;
+	ring->buffer = buffer;
+}
+
+/* Nur wenn weder Schreiber noch Leser aktiv sind. */
+static inline void rc_ring_reset(struct rc_ring *ring)
+{
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static inline bool rc_ring_empty(const struct rc_ring *ring)
+{
+	return READ_ONCE(ring->head) == READ_ONCE(ring->tail);
+}
+
+static inline bool rc_ring_put(struct rc_ring *ring, const void *entry)
+{
+	unsigned int head = ring->head;
+
+	if (head - smp_load_acquire(&ring->tail) > ring->mask)
+		return false;
+	memcpy(ring->buffer + (head & ring->mask) * ring->esize, entry, ring->esize);
+	smp_store_release(&ring->head, head + 1);
+	return true;
+}
+
+/*
+ * Kopiert so viele ganze Eintraege wie in count Bytes passen zum Userspace.
+ * Liefert die Anzahl kopierter Bytes oder -EFAULT.
+ */
+static inline ssize_t rc_ring_to_user(struct rc_ring *ring, char __user *to, size_t count)
+{
+	unsigned int tail = ring->tail;
+	unsigned int available = smp_load_acquire(&ring->head) - tail;
+	unsigned int n = min_t(size_t, available, count / ring->esize);
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (copy_to_user(to + i * ring->esize,
+				ring->buffer + ((tail + i) & ring->mask) * ring->esize, ring->esize))
+			break;
+	}
+	smp_store_release(&ring->tail, tail + i);
+	if (i == 0 && n > 0)
+		return -EFAULT;
+	return i * ring->esize;
+}
+
+/*
+ * Zustandsseite: Der Treiber legt seine aktuellen Werte in einer Seite ab,
+ * die der Userspace per mmap() nur lesend einblendet. Die Seite beginnt mit
+ * struct rc_snapshot_header, die Nutzdaten folgen direkt danach.
+ *
+ * sequence ist ein Seqcount: ungerade waehrend geschrieben wird. Ein Leser
+ * liest sequence, kopiert die Daten und liest sequence erneut; nur wenn
+ * beide Werte gleich und gerade sind, ist die Kopie konsistent.
+ */
+struct rc_snapshot_header {
+	u32 sequence;
+	u32 size;	/* Groesse der Nutzdaten in Byte */
+};
+
+struct rc_snapshot {
+	spinlock_t lock;	/* serialisiert die Schreiber */
+	struct rc_snapshot_header *header;
+};
+
+static inline int rc_snapshot_init(struct rc_snapshot *snapshot, size_t size)
+{
+	if (sizeof(struct rc_snapshot_header) + size > PAGE_SIZE)
+		return -EINVAL;
+	spin_lock_init(&snapshot->lock);
+	snapshot->header = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!snapshot->header)
+		return -ENOMEM;
+	SetPageReserved(virt_to_page(snapshot->header));
+	snapshot->header->size = size;
+	return 0;
+}
+
+static inline void rc_snapshot_free(struct rc_snapshot *snapshot)
+{
+	ClearPageReserved(virt_to_page(snapshot->header));
+	free_page((unsigned long)snapshot->header);
+}
+
+/* Liefert die Nutzdaten zum Beschreiben, danach rc_snapshot_end() aufrufen. */
+static inline void *rc_snapshot_begin(struct rc_snapshot *snapshot, unsigned long *flags)
+{
+	spin_lock_irqsave(&snapshot->lock, *flags);
+	WRITE_ONCE(snapshot->header->sequence, snapshot->header->sequence + 1);
+	smp_wmb();
+	return snapshot->header + 1;
+}
+
+static inline void rc_snapshot_end(struct rc_snapshot *snapshot, unsigned long flags)
+{
+	smp_wmb();
+	WRITE_ONCE(snapshot->header->sequence, snapshot->header->sequence + 1);
+	spin_unlock_irqrestore(&snapshot->lock, flags);
+}
+
+/* Fuer file_operations.mmap: blendet die Seite nur lesend ein. */
+static inline int rc_snapshot_mmap(struct rc_snapshot *snapshot, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_pfn_range(vma, vma->vm_start,
+		virt_to_phys(snapshot->header) >> PAGE_SHIFT,
+		vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+#endif
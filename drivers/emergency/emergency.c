@@ -10,106 +10,180 @@
 #include <linux/uaccess.h>
 #include <linux/interrupt.h>
 #include <linux/time.h>
-#include <linux/sched/signal.h>
-//#include <linux/signal.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include "rc_core.h"
+#include "motor.h"
+#include "emergency.h"
+#define CREATE_TRACE_POINTS
+#include "emergency_trace.h"
 
 static dev_t gpio_dev_number;
 static struct cdev *driver_object;
 static struct class *gpio_class;
 static struct device *emergency_dev;
-static struct timeval previous_time;
-static struct task_struct *task;
+static struct rc_debounce debounce;
 static int irq_pin;
-static int pid;
+static struct rc_irq_stamp irq_stamp;
+static DEFINE_SPINLOCK(event_lock);
+static DECLARE_WAIT_QUEUE_HEAD(event_wait);
+static struct emergency_event last_event;
+
+/* Pro geoeffneter Datei, jeder Leser bekommt jeden Tastendruck */
+struct emergency_reader {
+	u32 seen;
+};
 
 // ToDo: GPIO entsprechend der Verschaltung anpassen.
 #define INPUT_PIN    22
 
-int timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y)
-{
-  /* Perform the carry for the later subtraction by updating y. */
-  if (x->tv_usec < y->tv_usec) {
-    int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
-    y->tv_usec -= 1000000 * nsec;
-    y->tv_sec += nsec;
-  }
-  if (x->tv_usec - y->tv_usec > 1000000) {
-    int nsec = (x->tv_usec - y->tv_usec) / 1000000;
-    y->tv_usec += 1000000 * nsec;
-    y->tv_sec -= nsec;
-  }
-
-  /* Compute the time remaining to wait.
-     tv_usec is certainly positive. */
-  result->tv_sec = x->tv_sec - y->tv_sec;
-  result->tv_usec = x->tv_usec - y->tv_usec;
-
-  /* Return 1 if result is negative. */
-  return x->tv_sec < y->tv_sec;
-}
+// Nach einem Tastendruck werden weitere Flanken fuer diese Zeit ignoriert
+#define HOLDOFF_NS (250 * NSEC_PER_MSEC)
 
+/*
+ * Thread-Handler, die Zeit des Tastendrucks stammt aus dem harten Interrupt.
+ * Die Motoren werden direkt im Kernel angehalten, der Userspace erfaehrt
+ * davon per poll()/read() und muss nicht erst eingeplant werden.
+ */
 static irqreturn_t intr_handler(int irq, void *dev){
-	struct timeval current_time;
-	do_gettimeofday(&current_time);
-	struct timeval result;
-	timeval_subtract(&result, &current_time, &previous_time);
-	
-	if(result.tv_sec > 0 || result.tv_usec > 250000){
-		printk("Emergency %lu %lu", current_time.tv_sec, current_time.tv_usec);
-		int signum = SIGUSR1;
-		struct siginfo info;
-		memset(&info, 0, sizeof(struct siginfo));
-		info.si_signo = signum;
-		int ret = send_sig_info(signum, &info, task);
-		if (ret < 0) {
-			printk(KERN_INFO "error sending signal\n");
-		}
-		previous_time = current_time;
+	u64 now = irq_stamp.hardirq_ns;
+	unsigned long flags;
+	bool accepted = rc_debounce_holdoff(&debounce, now);
+
+	trace_emergency_irq(now, rc_irq_delay_ns(&irq_stamp), accepted);
+	if(accepted){
+		motor_emergency_stop();
+
+		spin_lock_irqsave(&event_lock, flags);
+		last_event.timestamp_ns = now;
+		last_event.presses++;
+		last_event.handler_delay_ns = rc_irq_delay_ns(&irq_stamp);
+		spin_unlock_irqrestore(&event_lock, flags);
+		wake_up_interruptible(&event_wait);
 	}
 	return IRQ_HANDLED;
 }
 
-static int driver_open( struct inode *geraetedatei, struct file *instanz )
+/*
+ * Taste und Interrupt gehoeren dem Modul, nicht einer geoeffneten Datei:
+ * Der Stopp im Kernel wirkt vom Laden bis zum Entladen, auch wenn kein
+ * Programm /dev/emergency geoeffnet hat.
+ */
+static int request_button(void)
 {
-	int err = -1;
-	err = gpio_request( INPUT_PIN, "rpi-gpio-echo" );
-	if (err) {
+	if (gpio_request( INPUT_PIN, "rpi-gpio-emergency" )) {
 		printk("gpio_request failed\n");
-		gpio_free( INPUT_PIN );
 		return -EIO;
 	}
-	err = gpio_direction_input( INPUT_PIN );
-	if (err) {
+	if (gpio_direction_input( INPUT_PIN )) {
 		printk("gpio_direction_input failed\n");
-		gpio_free( INPUT_PIN );
-		return -EIO;
+		goto free_gpio;
 	}
 
-	task = current;
+	rc_debounce_init(&debounce, HOLDOFF_NS);
 
 	if ( (irq_pin = gpio_to_irq(INPUT_PIN)) < 0 ) {
 		printk("GPIO to IRQ mapping failure %d\n", INPUT_PIN);
-		return -EIO;
+		goto free_gpio;
 	}
-
-	if (request_irq(irq_pin, intr_handler, IRQF_TRIGGER_RISING, "emergency", emergency_dev)) {
-			printk(KERN_INFO "short: can't get assigned irq %i\n", irq_pin);
-			return -EIO;
+	if (rc_request_irq(irq_pin, intr_handler, IRQF_TRIGGER_RISING, "emergency", &irq_stamp)) {
+		printk(KERN_INFO "short: can't get assigned irq %i\n", irq_pin);
+		goto free_gpio;
 	}
 	printk("gpio %d successfull configured\n", INPUT_PIN);
 	return 0;
+
+free_gpio:
+	gpio_free( INPUT_PIN );
+	return -EIO;
+}
+
+static void free_button(void)
+{
+	free_irq(irq_pin, &irq_stamp);
+	gpio_free( INPUT_PIN );
+}
+
+static int driver_open( struct inode *geraetedatei, struct file *instanz )
+{
+	struct emergency_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	// Nur Tastendruecke nach dem Oeffnen werden gemeldet
+	reader->seen = READ_ONCE(last_event.presses);
+	instanz->private_data = reader;
+	return 0;
 }
 
 static int driver_close( struct inode *geraete_datei, struct file *instanz )
 {
 	printk( "driver_close called\n");
-	free_irq(irq_pin, emergency_dev);
-	gpio_free( INPUT_PIN );
+	kfree(instanz->private_data);
+	return 0;
+}
+
+static bool event_pending(struct emergency_reader *reader)
+{
+	return READ_ONCE(last_event.presses) != reader->seen;
+}
+
+/*
+ * Liefert eine struct emergency_event. Ohne O_NONBLOCK blockiert read(), bis
+ * seit dem letzten read() die Taste gedrueckt wurde.
+ */
+static ssize_t driver_read( struct file *instanz, char __user *user,
+	size_t count, loff_t *offset )
+{
+	struct emergency_reader *reader = instanz->private_data;
+	struct emergency_event event;
+	unsigned long flags;
+
+	if (count < sizeof(event))
+		return -EINVAL;
+
+	if (instanz->f_flags & O_NONBLOCK) {
+		if (!event_pending(reader))
+			return -EAGAIN;
+	} else if (wait_event_interruptible(event_wait, event_pending(reader))) {
+		return -ERESTARTSYS;
+	}
+
+	spin_lock_irqsave(&event_lock, flags);
+	event = last_event;
+	spin_unlock_irqrestore(&event_lock, flags);
+	reader->seen = event.presses;
+
+	if (copy_to_user(user, &event, sizeof(event)))
+		return -EFAULT;
+	return sizeof(event);
+}
+
+/* Jedes write() hebt den Not-Aus wieder auf, die Motoren nehmen danach neue Befehle an. */
+static ssize_t driver_write( struct file *instanz, const char __user *user,
+	size_t count, loff_t *offset )
+{
+	motor_emergency_release();
+	return count;
+}
+
+static unsigned int driver_poll( struct file *instanz, poll_table *wait )
+{
+	struct emergency_reader *reader = instanz->private_data;
+
+	poll_wait(instanz, &event_wait, wait);
+	if (event_pending(reader))
+		return POLLIN | POLLRDNORM;
 	return 0;
 }
 
 static struct file_operations fops = {
 	.owner= THIS_MODULE,
+	.read = driver_read,
+	.write = driver_write,
+	.poll = driver_poll,
 	.open= driver_open,
 	.release= driver_close,
 };
@@ -133,18 +207,25 @@ static int __init mod_init( void )
 	}
 	emergency_dev = device_create( gpio_class, NULL, gpio_dev_number, NULL, "%s", "emergency" );
 
+	if (request_button())
+		goto free_device;
+
 	dev_info(emergency_dev, "mod_init");
 	return 0;
+free_device:
+	device_destroy( gpio_class, gpio_dev_number );
+	class_destroy( gpio_class );
 free_cdev:
 	kobject_put( &driver_object->kobj );
 free_device_number:
-	unregister_chrdev_region( gpio_dev_number, 2 );
+	unregister_chrdev_region( gpio_dev_number, 1 );
 	return -EIO;
 }
 
 static void __exit mod_exit( void )
 {
 	dev_info(emergency_dev, "mod_exit");
+	free_button();
 	/* Loeschen des Sysfs-Eintrags und damit der Geraetedatei */
 	device_destroy( gpio_class, gpio_dev_number );
 	class_destroy( gpio_class );
@@ -0,0 +1,16 @@
+#ifndef EMERGENCY_H
+#define EMERGENCY_H
+
+#include <linux/types.h>
+
+/*
+ * Das liefert read() pro Tastendruck. Kamen seit dem letzten read() mehrere,
+ * liefert es nur den neuesten, presses zeigt die Luecke.
+ */
+struct emergency_event {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC der Flanke im harten Interrupt */
+	__u32 presses;		/* gezaehlte Tastendruecke seit dem Laden des Moduls */
+	__u32 handler_delay_ns;	/* vom harten Interrupt bis zum Thread-Handler */
+};
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Tracepoints des Not-Aus Treibers, z.B. mit
+ *   echo 1 > /sys/kernel/debug/tracing/events/emergency/enable
+ * oder perf record -e 'emergency:*'. Abgeschaltet kosten sie nur einen
+ * nicht genommenen Sprung, im Gegensatz zu printk() im Interrupt-Handler.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM emergency
+
+#if !defined(_EMERGENCY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EMERGENCY_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Eintritt in den Thread-Handler, accepted = nicht vom Entprellen verworfen */
+TRACE_EVENT(emergency_irq,
+	TP_PROTO(u64 hardirq_ns, u32 handler_delay_ns, bool accepted),
+	TP_ARGS(hardirq_ns, handler_delay_ns, accepted),
+
+	TP_STRUCT__entry(
+		__field(u64, hardirq_ns)
+		__field(u32, handler_delay_ns)
+		__field(bool, accepted)
+	),
+
+	TP_fast_assign(
+		__entry->hardirq_ns = hardirq_ns;
+		__entry->handler_delay_ns = handler_delay_ns;
+		__entry->accepted = accepted;
+	),
+
+	TP_printk("hardirq_ns=%llu delay_ns=%u accepted=%d",
+		__entry->hardirq_ns, __entry->handler_delay_ns, __entry->accepted)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE emergency_trace
+#include <trace/define_trace.h>
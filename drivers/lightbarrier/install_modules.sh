@@ -5,7 +5,9 @@ if [ $# -eq 1 ]
     echo "Compiling and Installing to " $1
     make
     echo "Removing existing module"
-    ssh root@$1 'rmmod lightbarrier'
+    # motor uses the lightbarrier symbols, emergency the motor symbols,
+    # both have to be installed again afterwards
+    ssh root@$1 'rmmod emergency motor lightbarrier'
     echo "Copying module"
     scp configure_pullups.dtb root@$1:/boot/overlays/
     scp lightbarrier.ko root@$1:
@@ -10,159 +10,288 @@
 #include <linux/uaccess.h>
 #include <linux/interrupt.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include "rc_core.h"
+#include "lightbarrier.h"
+#define CREATE_TRACE_POINTS
+#include "lightbarrier_trace.h"
 
 static dev_t gpio_dev_number;
 static struct cdev *driver_object;
 static struct class *gpio_class;
-static struct device *lightbarrier_left_dev, *lightbarrier_right_dev;
-static struct timeval left_previous_time, right_previous_time;
-static int left_irq_pin, right_irq_pin;
-static long left_ticks, right_ticks;
 // ToDo: GPIO entsprechend der Verschaltung anpassen.
 #define LEFT_INPUT_PIN    21
 #define RIGHT_INPUT_PIN    20
 
-int timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y)
+// Flanken in kuerzerem Abstand werden als Prellen verworfen
+#define DEBOUNCE_NS (5 * NSEC_PER_MSEC)
+
+struct lightbarrier {
+	const char *name;
+	int pin, irq_pin;
+	struct device *dev;
+	struct mutex users_lock;
+	int users;
+	seqlock_t lock;
+	struct rc_irq_stamp irq;
+	struct rc_debounce debounce;
+	struct lightbarrier_state state;
+	wait_queue_head_t wait;
+};
+
+/* Pro geoeffneter Datei: bis zu welchem Zaehlerstand sie gelesen hat */
+struct lightbarrier_reader {
+	struct lightbarrier *lb;
+	long seen;
+};
+
+static struct rc_snapshot snapshot;
+
+static struct lightbarrier lightbarriers[2] = {
+	[LIGHTBARRIER_LEFT] = {
+		.name = "lightbarrier-left",
+		.pin = LEFT_INPUT_PIN,
+	},
+	[LIGHTBARRIER_RIGHT] = {
+		.name = "lightbarrier-right",
+		.pin = RIGHT_INPUT_PIN,
+	},
+};
+
+/*
+ * Flankenabstand merken und die Geschwindigkeit nachfuehren. Der Filter ist
+ * ein gleitender Mittelwert mit Gewicht 1/4 fuer den neuen Wert, nach einer
+ * Standzeit startet er mit dem ersten Abstand neu.
+ */
+static void record_period(struct lightbarrier_state *state, u64 period)
+{
+	u32 velocity;
+
+	if (period > LIGHTBARRIER_STANDSTILL_NS) {
+		state->period_ns = 0;
+		state->velocity = 0;
+		return;
+	}
+	velocity = div64_u64((u64)LIGHTBARRIER_UM_PER_TICK * USEC_PER_SEC, period);
+	if (!state->period_ns)
+		state->velocity = velocity;
+	else
+		state->velocity = (3 * state->velocity + velocity) / 4;
+	state->period_ns = period;
+
+	state->history_head = (state->history_head + 1) % LIGHTBARRIER_HISTORY;
+	state->history[state->history_head] = period;
+}
+
+static void update_snapshot(struct lightbarrier *lb)
 {
-  /* Perform the carry for the later subtraction by updating y. */
-  if (x->tv_usec < y->tv_usec) {
-    int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
-    y->tv_usec -= 1000000 * nsec;
-    y->tv_sec += nsec;
-  }
-  if (x->tv_usec - y->tv_usec > 1000000) {
-    int nsec = (x->tv_usec - y->tv_usec) / 1000000;
-    y->tv_usec += 1000000 * nsec;
-    y->tv_sec -= nsec;
-  }
-
-  /* Compute the time remaining to wait.
-     tv_usec is certainly positive. */
-  result->tv_sec = x->tv_sec - y->tv_sec;
-  result->tv_usec = x->tv_usec - y->tv_usec;
-
-  /* Return 1 if result is negative. */
-  return x->tv_sec < y->tv_sec;
+	struct lightbarrier_snapshot *page;
+	unsigned long flags;
+	int i = lb - lightbarriers;
+
+	page = rc_snapshot_begin(&snapshot, &flags);
+	page->wheels[i].ticks = lb->state.ticks;
+	page->wheels[i].velocity = lb->state.velocity;
+	page->wheels[i].last_tick_ns = lb->state.last_tick_ns;
+	page->wheels[i].period_ns = lb->state.period_ns;
+	rc_snapshot_end(&snapshot, flags);
 }
 
+/* Thread-Handler, die Zeit der Flanke stammt aus dem harten Interrupt */
 static irqreturn_t intr_handler(int irq, void *dev){
-	struct timeval current_time;
-	do_gettimeofday(&current_time);
-	struct timeval result;
-
-	if (irq == left_irq_pin) {
-		timeval_subtract(&result, &current_time, &left_previous_time);
-
-		if(result.tv_sec > 0 || result.tv_usec > 5000) {
-			left_ticks++;
-		}
-		left_previous_time = current_time;
-	} else {
-		timeval_subtract(&result, &current_time, &right_previous_time);
-
-		if(result.tv_sec > 0 || result.tv_usec > 5000) {
-			right_ticks++;
-		}
-		right_previous_time = current_time;
+	struct lightbarrier *lb = container_of(dev, struct lightbarrier, irq);
+	u64 now = lb->irq.hardirq_ns;
+	bool counted = rc_debounce_quiet(&lb->debounce, now);
+
+	if (counted) {
+		write_seqlock(&lb->lock);
+		if (lb->state.last_tick_ns)
+			record_period(&lb->state, now - lb->state.last_tick_ns);
+		lb->state.last_tick_ns = now;
+		lb->state.ticks++;
+		lb->state.handler_delay_ns = rc_irq_delay_ns(&lb->irq);
+		update_snapshot(lb);
+		write_sequnlock(&lb->lock);
+		wake_up_interruptible(&lb->wait);
 	}
+	// Nur dieser Handler schreibt state, ticks ist ohne Lock aktuell
+	trace_lightbarrier_irq(lb - lightbarriers, now, rc_irq_delay_ns(&lb->irq), counted,
+		lb->state.ticks);
 	return IRQ_HANDLED;
 }
 
-static int driver_open( struct inode *geraetedatei, struct file *instanz )
+int lightbarrier_get(enum lightbarrier_side side)
 {
-	int err = -1;
-	struct device* lightbarrier_dev;
-	int pin, *irq_pin;
-
-	if (iminor(geraetedatei)==0) {
-		pin = LEFT_INPUT_PIN;
-		lightbarrier_dev = lightbarrier_left_dev;
-    irq_pin = &left_irq_pin;
-	} else {
-		pin = RIGHT_INPUT_PIN;
-		lightbarrier_dev = lightbarrier_right_dev;
-    irq_pin = &right_irq_pin;
-	}
+	struct lightbarrier *lb = &lightbarriers[side];
+	int err = 0;
+
+	mutex_lock(&lb->users_lock);
+	if (lb->users++)
+		goto out;
 
-	err = gpio_request( pin, "rpi-gpio-echo" );
+	err = gpio_request( lb->pin, "rpi-gpio-echo" );
 	if (err) {
 		printk("gpio_request failed\n");
-		gpio_free( pin );
-		return -EIO;
+		err = -EIO;
+		goto failed;
 	}
-	err = gpio_direction_input( pin );
+	err = gpio_direction_input( lb->pin );
 	if (err) {
 		printk("gpio_direction_input failed\n");
-		gpio_free( pin );
-		return -EIO;
+		err = -EIO;
+		goto free_gpio;
+	}
+
+	if ( (lb->irq_pin = gpio_to_irq(lb->pin)) < 0 ) {
+		printk("GPIO to IRQ mapping failure %d\n", lb->pin);
+		err = -EIO;
+		goto free_gpio;
 	}
 
-  if ( (*irq_pin = gpio_to_irq(pin)) < 0 ) {
-    printk("GPIO to IRQ mapping failure %d\n", pin);
-    gpio_free( pin );
-    return -EIO;
-  }
+	write_seqlock_irq(&lb->lock);
+	lb->state.last_tick_ns = 0;
+	lb->state.period_ns = 0;
+	lb->state.velocity = 0;
+	memset(lb->state.history, 0, sizeof(lb->state.history));
+	update_snapshot(lb);
+	write_sequnlock_irq(&lb->lock);
+
+	if (rc_request_irq(lb->irq_pin, intr_handler, IRQF_TRIGGER_FALLING, lb->name, &lb->irq)) {
+		printk(KERN_INFO "short: can't get assigned irq %i\n", lb->irq_pin);
+		err = -EIO;
+		goto free_gpio;
+	}
 
-  if (request_irq(*irq_pin, intr_handler, IRQF_TRIGGER_FALLING, "lightbarrier_left", lightbarrier_dev)) {
-    printk(KERN_INFO "short: can't get assigned irq %i\n", *irq_pin);
-    gpio_free( pin );
-    return -EIO;
-  }
+	printk("gpio  %d successfull configured\n", lb->pin);
+	goto out;
 
-	printk("gpio  %d successfull configured\n", pin);
-	return 0;
+free_gpio:
+	gpio_free( lb->pin );
+failed:
+	lb->users--;
+out:
+	mutex_unlock(&lb->users_lock);
+	return err;
 }
+EXPORT_SYMBOL(lightbarrier_get);
 
-static int driver_close( struct inode *geraetedatei, struct file *instanz )
+void lightbarrier_put(enum lightbarrier_side side)
 {
-	printk( "driver_close called\n");
+	struct lightbarrier *lb = &lightbarriers[side];
 
-	struct device* lightbarrier_dev;
-	int pin, irq_pin;
+	mutex_lock(&lb->users_lock);
+	if (--lb->users == 0) {
+		free_irq(lb->irq_pin, &lb->irq);
+		gpio_free(lb->pin);
+	}
+	mutex_unlock(&lb->users_lock);
+}
+EXPORT_SYMBOL(lightbarrier_put);
+
+void lightbarrier_read(enum lightbarrier_side side, struct lightbarrier_state *state)
+{
+	struct lightbarrier *lb = &lightbarriers[side];
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&lb->lock);
+		*state = lb->state;
+	} while (read_seqretry(&lb->lock, seq));
+}
+EXPORT_SYMBOL(lightbarrier_read);
+
+static int driver_open( struct inode *geraetedatei, struct file *instanz )
+{
+	struct lightbarrier_reader *reader;
+	int err;
 
-	if (iminor(geraetedatei)==0) {
-		pin = LEFT_INPUT_PIN;
-		lightbarrier_dev = lightbarrier_left_dev;
-	} else {
-		pin = RIGHT_INPUT_PIN;
-		lightbarrier_dev = lightbarrier_right_dev;
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	err = lightbarrier_get(iminor(geraetedatei));
+	if (err) {
+		kfree(reader);
+		return err;
 	}
+	reader->lb = &lightbarriers[iminor(geraetedatei)];
+	reader->seen = READ_ONCE(reader->lb->state.ticks);
+	instanz->private_data = reader;
+	return 0;
+}
 
-	free_irq(gpio_to_irq(pin), lightbarrier_dev);
-	gpio_free(pin);
+static int driver_close( struct inode *geraetedatei, struct file *instanz )
+{
+	printk( "driver_close called\n");
+	lightbarrier_put(iminor(geraetedatei));
+	kfree(instanz->private_data);
 	return 0;
 }
 
 static ssize_t driver_read( struct file *instanz, char __user *user,
 	size_t count, loff_t *offset )
 {
+	struct lightbarrier_reader *reader = instanz->private_data;
+	struct lightbarrier_state state;
+	struct lightbarrier_sample sample;
 	int to_copy, not_copied;
-	int ticks;
+	int i;
 
-	if (iminor(instanz->f_inode)==0) {
-		ticks = left_ticks;
-	} else {
-		ticks = right_ticks;
-	}
+	lightbarrier_read(iminor(instanz->f_inode), &state);
+	reader->seen = state.ticks;
 
-	// Echopin zur Applikation kopieren
-	to_copy = min( count, sizeof(ticks) );
-	not_copied=copy_to_user( user, &ticks, to_copy );
+	sample.ticks = state.ticks;
+	sample.velocity = lightbarrier_velocity(&state, rc_now_ns());
+	sample.last_tick_ns = state.last_tick_ns;
+	for (i = 0; i < LIGHTBARRIER_HISTORY; i++)
+		sample.periods_ns[i] = state.history[
+			(state.history_head + LIGHTBARRIER_HISTORY - i) % LIGHTBARRIER_HISTORY];
+	sample.handler_delay_ns = state.handler_delay_ns;
+	sample.reserved = 0;
+
+	// Zaehlerstand (und bei genug Platz die Zeiten) zur Applikation kopieren
+	to_copy = min( count, sizeof(sample) );
+	not_copied=copy_to_user( user, &sample, to_copy );
 
 	return to_copy-not_copied;
 }
 
+static unsigned int driver_poll( struct file *instanz, poll_table *wait )
+{
+	struct lightbarrier_reader *reader = instanz->private_data;
+
+	poll_wait(instanz, &reader->lb->wait, wait);
+	if (READ_ONCE(reader->lb->state.ticks) != reader->seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/* Beide Geraete blenden dieselbe Zustandsseite ein. */
+static int driver_mmap( struct file *instanz, struct vm_area_struct *vma )
+{
+	return rc_snapshot_mmap(&snapshot, vma);
+}
+
 static struct file_operations fops = {
 	.owner= THIS_MODULE,
 	.read = driver_read,
+	.poll = driver_poll,
+	.mmap = driver_mmap,
 	.open= driver_open,
 	.release= driver_close,
 };
 
 static int __init mod_init( void )
 {
+	int i;
+
+	if( rc_snapshot_init(&snapshot, sizeof(struct lightbarrier_snapshot)) )
+		return -ENOMEM;
 	if( alloc_chrdev_region(&gpio_dev_number,0,2,"lightbarrier")<0 )
-		return -EIO;
+		goto free_snapshot;
 	driver_object = cdev_alloc(); /* Anmeldeobjekt reservieren */
 	if( driver_object==NULL )
 		goto free_device_number;
@@ -176,24 +305,29 @@ static int __init mod_init( void )
 		pr_err( "gpio: no udev support\n");
 		goto free_cdev;
 	}
-	lightbarrier_left_dev = device_create( gpio_class, NULL, gpio_dev_number,
-		NULL, "%s", "lightbarrier-left" );
-	lightbarrier_right_dev = device_create( gpio_class, NULL, gpio_dev_number +1,
-		NULL, "%s", "lightbarrier-right" );
-
+	for (i = 0; i < ARRAY_SIZE(lightbarriers); i++) {
+		mutex_init(&lightbarriers[i].users_lock);
+		seqlock_init(&lightbarriers[i].lock);
+		rc_debounce_init(&lightbarriers[i].debounce, DEBOUNCE_NS);
+		init_waitqueue_head(&lightbarriers[i].wait);
+		lightbarriers[i].dev = device_create( gpio_class, NULL, gpio_dev_number + i,
+			NULL, "%s", lightbarriers[i].name );
+	}
 
-	dev_info(lightbarrier_left_dev, "mod_init");
+	dev_info(lightbarriers[LIGHTBARRIER_LEFT].dev, "mod_init");
 	return 0;
 free_cdev:
 	kobject_put( &driver_object->kobj );
 free_device_number:
 	unregister_chrdev_region( gpio_dev_number, 2 );
+free_snapshot:
+	rc_snapshot_free(&snapshot);
 	return -EIO;
 }
 
 static void __exit mod_exit( void )
 {
-	dev_info(lightbarrier_left_dev, "mod_exit");
+	dev_info(lightbarriers[LIGHTBARRIER_LEFT].dev, "mod_exit");
 	/* Loeschen des Sysfs-Eintrags und damit der Geraetedatei */
 	device_destroy( gpio_class, gpio_dev_number + 1);
 	device_destroy( gpio_class, gpio_dev_number );
@@ -201,6 +335,7 @@ static void __exit mod_exit( void )
 	/* Abmelden des Treibers */
 	cdev_del( driver_object );
 	unregister_chrdev_region( gpio_dev_number, 2 );
+	rc_snapshot_free(&snapshot);
 	return;
 }
 
@@ -0,0 +1,82 @@
+#ifndef LIGHTBARRIER_H
+#define LIGHTBARRIER_H
+
+#include <linux/types.h>
+#include <linux/math64.h>
+#include <linux/time64.h>
+
+enum lightbarrier_side { LIGHTBARRIER_LEFT, LIGHTBARRIER_RIGHT };
+
+// 1 Lichtschrankenunterbrechung entspricht 11,25 mm
+#define LIGHTBARRIER_UM_PER_TICK 11250
+// Ohne Flanke fuer diese Zeit gilt das Rad als stehend
+#define LIGHTBARRIER_STANDSTILL_NS (500 * NSEC_PER_MSEC)
+// Anzahl gespeicherter Flankenabstaende
+#define LIGHTBARRIER_HISTORY 8
+
+/* Zustand einer Lichtschranke, von anderen Treibern per lightbarrier_read() lesbar */
+struct lightbarrier_state {
+	long ticks;
+	u64 last_tick_ns;	/* CLOCK_MONOTONIC der letzten gezaehlten Flanke im harten Interrupt */
+	u64 period_ns;		/* Abstand der letzten beiden gezaehlten Flanken, 0 = unbekannt */
+	u32 velocity;		/* gefilterte Geschwindigkeit in mm/s */
+	u32 history[LIGHTBARRIER_HISTORY];	/* Flankenabstaende in ns, Ringpuffer */
+	unsigned int history_head;		/* Index des neuesten Eintrags */
+	u32 handler_delay_ns;	/* letzte Flanke: vom harten Interrupt bis zum Zaehlen */
+};
+
+/*
+ * Das liefert read(), wenn der Puffer gross genug ist. Mit 4 Byte liefert
+ * read() wie bisher nur den Zaehlerstand. poll() meldet POLLIN, sobald seit
+ * dem letzten read() auf derselben Datei eine Flanke gezaehlt wurde.
+ */
+struct lightbarrier_sample {
+	s32 ticks;
+	u32 velocity;			/* gefiltert in mm/s, faellt ohne Flanken ab */
+	u64 last_tick_ns;
+	u32 periods_ns[LIGHTBARRIER_HISTORY];	/* neuester zuerst, 0 = unbekannt */
+	u32 handler_delay_ns;
+	u32 reserved;
+};
+
+/* Zustandsseite fuer mmap(), hinter struct rc_snapshot_header */
+struct lightbarrier_snapshot {
+	struct {
+		s32 ticks;
+		u32 velocity;		/* gefiltert in mm/s, ohne Abfall seit last_tick_ns */
+		u64 last_tick_ns;
+		u64 period_ns;
+	} wheels[2];
+};
+
+/*
+ * Gefilterte Geschwindigkeit in mm/s zum Zeitpunkt now. Kam seit der letzten
+ * Flanke laenger keine neue, faehrt das Rad hoechstens eine Strecke pro
+ * vergangener Zeit.
+ */
+static inline u32 lightbarrier_velocity(const struct lightbarrier_state *state, u64 now)
+{
+	u64 since;
+	u32 bound;
+
+	if (!state->period_ns)
+		return 0;
+	since = now > state->last_tick_ns ? now - state->last_tick_ns : 0;
+	if (since > LIGHTBARRIER_STANDSTILL_NS)
+		return 0;
+	if (since <= state->period_ns)
+		return state->velocity;
+	bound = div64_u64((u64)LIGHTBARRIER_UM_PER_TICK * USEC_PER_SEC, since);
+	return min(state->velocity, bound);
+}
+
+/*
+ * lightbarrier_get() meldet einen Nutzer an und fordert beim ersten Nutzer
+ * GPIO und Interrupt an, lightbarrier_put() gibt sie beim letzten wieder frei.
+ * Nur im Prozesskontext aufrufen.
+ */
+int lightbarrier_get(enum lightbarrier_side side);
+void lightbarrier_put(enum lightbarrier_side side);
+void lightbarrier_read(enum lightbarrier_side side, struct lightbarrier_state *state);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Tracepoints des Lichtschranken-Treibers (events/lightbarrier/ im
+ * Tracing-Verzeichnis). Abgeschaltet kosten sie nur einen nicht genommenen
+ * Sprung.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lightbarrier
+
+#if !defined(_LIGHTBARRIER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LIGHTBARRIER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Jede Flanke am Ende des Thread-Handlers, counted = nicht als Prellen
+ * verworfen, ticks ist der Zaehlerstand danach
+ */
+TRACE_EVENT(lightbarrier_irq,
+	TP_PROTO(int side, u64 hardirq_ns, u32 handler_delay_ns, bool counted, long ticks),
+	TP_ARGS(side, hardirq_ns, handler_delay_ns, counted, ticks),
+
+	TP_STRUCT__entry(
+		__field(int, side)
+		__field(u64, hardirq_ns)
+		__field(u32, handler_delay_ns)
+		__field(bool, counted)
+		__field(long, ticks)
+	),
+
+	TP_fast_assign(
+		__entry->side = side;
+		__entry->hardirq_ns = hardirq_ns;
+		__entry->handler_delay_ns = handler_delay_ns;
+		__entry->counted = counted;
+		__entry->ticks = ticks;
+	),
+
+	TP_printk("side=%s hardirq_ns=%llu delay_ns=%u counted=%d ticks=%ld",
+		__entry->side ? "right" : "left", __entry->hardirq_ns,
+		__entry->handler_delay_ns, __entry->counted, __entry->ticks)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lightbarrier_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+if [ $# -eq 1 ]
+  then
+    echo "Compiling and Installing to " $1
+    make
+    echo "Removing existing module"
+    ssh root@$1 'rmmod linesensor'
+    echo "Copying module"
+    scp linesensor.ko root@$1:
+    echo "Installing module"
+    ssh root@$1 'insmod /root/linesensor.ko'
+  else
+    echo "./build.sh <IP_OF_RASPBERRY>"
+fi
+
+
@@ -0,0 +1,293 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <asm/io.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/gpio.h>
+#include <linux/slab.h>
+#include <asm/uaccess.h>
+#include <linux/uaccess.h>
+#include <linux/interrupt.h>
+#include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include "rc_core.h"
+#include "linesensor.h"
+#define CREATE_TRACE_POINTS
+#include "linesensor_trace.h"
+
+static dev_t gpio_dev_number;
+static struct cdev *driver_object;
+static struct class *gpio_class;
+static struct device *linesensor_dev;
+
+// ToDo: GPIO entsprechend der Verschaltung anpassen.
+#define LEFT_PIN           14
+#define MIDDLE_LEFT_PIN    15
+#define MIDDLE_RIGHT_PIN   12
+#define RIGHT_PIN          16
+
+struct line {
+	const char *name;
+	int pin, irq_pin;
+	struct rc_irq_stamp irq;
+};
+
+static struct line lines[LINESENSOR_LINES] = {
+	[LINESENSOR_LEFT] = { .name = "line-left", .pin = LEFT_PIN },
+	[LINESENSOR_MIDDLE_LEFT] = { .name = "line-middle-left", .pin = MIDDLE_LEFT_PIN },
+	[LINESENSOR_MIDDLE_RIGHT] = { .name = "line-middle-right", .pin = MIDDLE_RIGHT_PIN },
+	[LINESENSOR_RIGHT] = { .name = "line-right", .pin = RIGHT_PIN },
+};
+
+static DEFINE_MUTEX(users_lock);
+static int users;
+static DEFINE_SPINLOCK(state_lock);	/* schuetzt state und die Zustandsseite */
+static struct linesensor_state state;
+static struct rc_snapshot snapshot;
+static DECLARE_WAIT_QUEUE_HEAD(state_wait);
+
+/* Pro geoeffneter Datei: welchen Stand sie zuletzt gelesen hat */
+struct linesensor_reader {
+	u32 seen;
+};
+
+/* Aufruf mit state_lock */
+static void update_snapshot(void)
+{
+	struct linesensor_state *page;
+	unsigned long flags;
+
+	page = rc_snapshot_begin(&snapshot, &flags);
+	*page = state;
+	rc_snapshot_end(&snapshot, flags);
+}
+
+/*
+ * Thread-Handler fuer beide Flanken eines Sensors. Der Pegel wird erst hier
+ * gelesen; kam in der Zwischenzeit schon die Gegenflanke, loest sie nach dem
+ * Handler einen weiteren Interrupt aus und die Maske stimmt danach wieder.
+ */
+static irqreturn_t intr_handler(int irq, void *dev){
+	struct line *line = container_of(dev, struct line, irq);
+	u32 bit = BIT(line - lines);
+	unsigned long flags;
+
+	spin_lock_irqsave(&state_lock, flags);
+	if (gpio_get_value(line->pin))
+		state.mask |= bit;
+	else
+		state.mask &= ~bit;
+	state.changed_ns[line - lines] = line->irq.hardirq_ns;
+	state.sequence++;
+	update_snapshot();
+	trace_linesensor_irq(line - lines, line->irq.hardirq_ns,
+		rc_irq_delay_ns(&line->irq), state.mask);
+	spin_unlock_irqrestore(&state_lock, flags);
+
+	wake_up_interruptible(&state_wait);
+	return IRQ_HANDLED;
+}
+
+static void free_lines(int count)
+{
+	while (count-- > 0) {
+		free_irq(lines[count].irq_pin, &lines[count].irq);
+		gpio_free(lines[count].pin);
+	}
+}
+
+static int request_line(struct line *line)
+{
+	if (gpio_request( line->pin, line->name )) {
+		printk("gpio_request failed\n");
+		return -EIO;
+	}
+	if (gpio_direction_input( line->pin )) {
+		printk("gpio_direction_input failed\n");
+		goto free_gpio;
+	}
+	if ( (line->irq_pin = gpio_to_irq(line->pin)) < 0 ) {
+		printk("GPIO to IRQ mapping failure %d\n", line->pin);
+		goto free_gpio;
+	}
+	if (rc_request_irq(line->irq_pin, intr_handler,
+			IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, line->name, &line->irq)) {
+		printk(KERN_INFO "short: can't get assigned irq %i\n", line->irq_pin);
+		goto free_gpio;
+	}
+	return 0;
+
+free_gpio:
+	gpio_free( line->pin );
+	return -EIO;
+}
+
+/* Beim ersten Nutzer GPIOs und Interrupts anfordern und die Pegel einlesen. */
+static int linesensor_get(void)
+{
+	unsigned long flags;
+	int err = 0;
+	int i;
+
+	mutex_lock(&users_lock);
+	if (users++)
+		goto out;
+
+	for (i = 0; i < LINESENSOR_LINES; i++) {
+		err = request_line(&lines[i]);
+		if (err) {
+			free_lines(i);
+			users--;
+			goto out;
+		}
+	}
+
+	spin_lock_irqsave(&state_lock, flags);
+	state.mask = 0;
+	for (i = 0; i < LINESENSOR_LINES; i++) {
+		if (gpio_get_value(lines[i].pin))
+			state.mask |= BIT(i);
+	}
+	state.sequence++;
+	update_snapshot();
+	spin_unlock_irqrestore(&state_lock, flags);
+
+	printk("gpio %d, %d, %d and %d successfull configured\n", lines[0].pin,
+		lines[1].pin, lines[2].pin, lines[3].pin);
+out:
+	mutex_unlock(&users_lock);
+	return err;
+}
+
+static void linesensor_put(void)
+{
+	mutex_lock(&users_lock);
+	if (--users == 0)
+		free_lines(LINESENSOR_LINES);
+	mutex_unlock(&users_lock);
+}
+
+static int driver_open( struct inode *geraetedatei, struct file *instanz )
+{
+	struct linesensor_reader *reader;
+	int err;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	err = linesensor_get();
+	if (err) {
+		kfree(reader);
+		return err;
+	}
+	reader->seen = READ_ONCE(state.sequence);
+	instanz->private_data = reader;
+	return 0;
+}
+
+static int driver_close( struct inode *geraetedatei, struct file *instanz )
+{
+	printk( "driver_close called\n");
+	linesensor_put();
+	kfree(instanz->private_data);
+	return 0;
+}
+
+/* Maske und Zeitstempel aller Sensoren mit einem Aufruf */
+static ssize_t driver_read( struct file *instanz, char __user *user,
+	size_t count, loff_t *offset )
+{
+	struct linesensor_reader *reader = instanz->private_data;
+	struct linesensor_state copy;
+	unsigned long flags;
+	int to_copy, not_copied;
+
+	spin_lock_irqsave(&state_lock, flags);
+	copy = state;
+	spin_unlock_irqrestore(&state_lock, flags);
+	reader->seen = copy.sequence;
+
+	to_copy = min( count, sizeof(copy) );
+	not_copied=copy_to_user( user, &copy, to_copy );
+
+	return to_copy-not_copied;
+}
+
+static unsigned int driver_poll( struct file *instanz, poll_table *wait )
+{
+	struct linesensor_reader *reader = instanz->private_data;
+
+	poll_wait(instanz, &state_wait, wait);
+	if (READ_ONCE(state.sequence) != reader->seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static int driver_mmap( struct file *instanz, struct vm_area_struct *vma )
+{
+	return rc_snapshot_mmap(&snapshot, vma);
+}
+
+static struct file_operations fops = {
+	.owner= THIS_MODULE,
+	.read = driver_read,
+	.poll = driver_poll,
+	.mmap = driver_mmap,
+	.open= driver_open,
+	.release= driver_close,
+};
+
+static int __init mod_init( void )
+{
+	if( rc_snapshot_init(&snapshot, sizeof(struct linesensor_state)) )
+		return -ENOMEM;
+	if( alloc_chrdev_region(&gpio_dev_number,0,1,"linesensor")<0 )
+		goto free_snapshot;
+	driver_object = cdev_alloc(); /* Anmeldeobjekt reservieren */
+	if( driver_object==NULL )
+		goto free_device_number;
+	driver_object->owner = THIS_MODULE;
+	driver_object->ops = &fops;
+	if( cdev_add(driver_object,gpio_dev_number,1) )
+		goto free_cdev;
+	/* Eintrag im Sysfs, damit Udev den Geraetedateieintrag erzeugt. */
+	gpio_class = class_create( THIS_MODULE, "linesensor" );
+	if( IS_ERR( gpio_class ) ) {
+		pr_err( "gpio: no udev support\n");
+		goto free_cdev;
+	}
+	linesensor_dev = device_create( gpio_class, NULL, gpio_dev_number, NULL, "%s", "linesensor" );
+
+	dev_info(linesensor_dev, "mod_init");
+	return 0;
+free_cdev:
+	kobject_put( &driver_object->kobj );
+free_device_number:
+	unregister_chrdev_region( gpio_dev_number, 1 );
+free_snapshot:
+	rc_snapshot_free(&snapshot);
+	return -EIO;
+}
+
+static void __exit mod_exit( void )
+{
+	dev_info(linesensor_dev, "mod_exit");
+	/* Loeschen des Sysfs-Eintrags und damit der Geraetedatei */
+	device_destroy( gpio_class, gpio_dev_number );
+	class_destroy( gpio_class );
+	/* Abmelden des Treibers */
+	cdev_del( driver_object );
+	unregister_chrdev_region( gpio_dev_number, 1 );
+	rc_snapshot_free(&snapshot);
+	return;
+}
+
+module_init( mod_init );
+module_exit( mod_exit );
+
+/* Metainformation */
+MODULE_LICENSE("GPL");
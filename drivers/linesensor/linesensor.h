@@ -0,0 +1,27 @@
+#ifndef LINESENSOR_H
+#define LINESENSOR_H
+
+#include <linux/types.h>
+
+/* Bitnummern in linesensor_state.mask, von links nach rechts */
+enum linesensor_line {
+	LINESENSOR_LEFT,
+	LINESENSOR_MIDDLE_LEFT,
+	LINESENSOR_MIDDLE_RIGHT,
+	LINESENSOR_RIGHT,
+	LINESENSOR_LINES
+};
+
+/*
+ * Das liefert read() auf /dev/linesensor, dieselben Daten stehen hinter
+ * struct rc_snapshot_header in der per mmap() lesbaren Zustandsseite.
+ * poll() meldet POLLIN, sobald sich seit dem letzten read() auf derselben
+ * Datei ein Sensor geaendert hat.
+ */
+struct linesensor_state {
+	__u32 mask;		/* Bit gesetzt: Pegel des Sensors ist high (Linie erkannt) */
+	__u32 sequence;		/* zaehlt jede Flanke aller Sensoren */
+	__u64 changed_ns[LINESENSOR_LINES];	/* letzte Flanke im harten Interrupt, 0 = noch keine */
+};
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * Tracepoints des Liniensensor-Treibers (events/linesensor/ im
+ * Tracing-Verzeichnis). Abgeschaltet kosten sie nur einen nicht genommenen
+ * Sprung.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM linesensor
+
+#if !defined(_LINESENSOR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LINESENSOR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Flanke eines Sensors im Thread-Handler, mask ist die neue Maske aller Sensoren */
+TRACE_EVENT(linesensor_irq,
+	TP_PROTO(int line, u64 hardirq_ns, u32 handler_delay_ns, u32 mask),
+	TP_ARGS(line, hardirq_ns, handler_delay_ns, mask),
+
+	TP_STRUCT__entry(
+		__field(int, line)
+		__field(u64, hardirq_ns)
+		__field(u32, handler_delay_ns)
+		__field(u32, mask)
+	),
+
+	TP_fast_assign(
+		__entry->line = line;
+		__entry->hardirq_ns = hardirq_ns;
+		__entry->handler_delay_ns = handler_delay_ns;
+		__entry->mask = mask;
+	),
+
+	TP_printk("line=%d hardirq_ns=%llu delay_ns=%u mask=%#x",
+		__entry->line, __entry->hardirq_ns, __entry->handler_delay_ns, __entry->mask)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE linesensor_trace
+#include <trace/define_trace.h>
@@ -8,7 +8,8 @@ if [ $# -eq 1 ]
     echo "Compiling and Installing to " $1
     make
     echo "Removing existing module"
-    ssh root@$1 'rmmod motor'
+    # emergency uses the motor symbols and has to be installed again afterwards
+    ssh root@$1 'rmmod emergency motor'
     echo "Copying module"
     scp configure_pwm.dtb root@$1:/boot/overlays/
     scp motor.ko root@$1:
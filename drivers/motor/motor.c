@@ -13,21 +13,106 @@
 #include <linux/pwm.h>
 #include <linux/of.h>
 #include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#include "rc_core.h"
+#include "lightbarrier.h"
+#include "motor.h"
+#define CREATE_TRACE_POINTS
+#include "motor_trace.h"
 
 static dev_t gpio_dev_number;
 static struct cdev *driver_object;
 static struct class *gpio_class;
-static struct device *motorl_dev, *motorr_dev;
-static struct pwm_device *pwm_left, *pwm_right;
-struct mutex mutex_left, mutex_right;
 // ToDo: Hier muessen die verwendeten GPIOs eingetragen werden
 #define ML1   6
 #define ML2   5
 #define MR1   23
 #define MR2   24
 
-// PWM Frequency in Hz
-#define PWM_FREQ 1000
+// Grenzen der PWM Frequenz in Hz
+#define PWM_FREQ_MIN 100
+#define PWM_FREQ_MAX 100000
+
+/*
+ * Frequenz, mit der jeder Motor beim Laden startet. Zur Laufzeit pro Motor
+ * ueber MOTOR_IOC_SET_PWM_FREQ oder /sys/class/motor/<motor>/pwm_freq.
+ */
+static int pwm_freq = 1000;
+module_param(pwm_freq, int, 0444);
+MODULE_PARM_DESC(pwm_freq, "PWM Frequenz in Hz beim Laden");
+
+// Periode des Geschwindigkeitsreglers
+#define CONTROL_PERIOD_NS (10 * NSEC_PER_MSEC)
+
+/*
+ * Reglerparameter. Die Stellgroesse wird in 1/1000 % PWM gerechnet und in
+ * Promille ausgegeben:
+ * kp pro mm/s Regelabweichung, ki pro mm aufsummierter Abweichung,
+ * kd pro mm/s^2 Aenderung der Abweichung.
+ */
+static int kp = 50;
+module_param(kp, int, 0644);
+MODULE_PARM_DESC(kp, "Proportionalanteil in 0.001%/(mm/s)");
+static int ki = 100;
+module_param(ki, int, 0644);
+MODULE_PARM_DESC(ki, "Integralanteil in 0.001%/mm");
+static int kd = 0;
+module_param(kd, int, 0644);
+MODULE_PARM_DESC(kd, "Differentialanteil in 0.001%/(mm/s^2)");
+
+/*
+ * Rampe fuer die direkte Ansteuerung: write() setzt dann nur das Ziel, der
+ * Regler-Thread faehrt den PWM Wert mit dieser Rate dorthin. 0 = aus.
+ */
+static int slew_rate = 0;
+module_param(slew_rate, int, 0644);
+MODULE_PARM_DESC(slew_rate, "Maximale Aenderung der direkten Ansteuerung in %/s, 0 = sofort");
+
+struct motor {
+	const char *name;
+	int in1, in2;
+	enum lightbarrier_side lightbarrier;
+	struct device *dev;
+	struct pwm_device *pwm;
+	struct mutex lock;	/* schuetzt alle folgenden Felder */
+	bool opened;		/* GPIOs reserviert */
+	int speed;		/* zuletzt an die Hardware gegebener Wert in Promille */
+	unsigned int period_ns;	/* PWM Periode */
+	bool ramping;		/* Rampe zu ramp_target laeuft */
+	int ramp_target;	/* in Promille */
+	bool speed_control;
+	int target_mm_per_s;
+	s64 integral;		/* in um */
+	int previous_error;
+};
+
+enum motor { left, right };
+
+static struct motor motors[2] = {
+	[left] = {
+		.name = "motor-left",
+		.in1 = ML1,
+		.in2 = ML2,
+		.lightbarrier = LIGHTBARRIER_LEFT,
+	},
+	[right] = {
+		.name = "motor-right",
+		.in1 = MR1,
+		.in2 = MR2,
+		.lightbarrier = LIGHTBARRIER_RIGHT,
+	},
+};
+
+static struct task_struct *control_thread;
+static DECLARE_WAIT_QUEUE_HEAD(control_wait);
+
+/* Gesetzt von motor_emergency_stop(), solange bleiben die Motoren aus */
+static bool emergency_stop;
 
 static int my_probe(struct platform_device *pdev)
 {
@@ -41,14 +126,14 @@ static int my_probe(struct platform_device *pdev)
     }
 
 	if(strcmp(side, "left")){
-		pwm_left = pwm_get(&pdev->dev, NULL);
-		if (IS_ERR(pwm_left)){
+		motors[left].pwm = pwm_get(&pdev->dev, NULL);
+		if (IS_ERR(motors[left].pwm)){
 			printk("Requesting left PWM failed");
 			return -EIO;
 		}
 	} else if(strcmp(side, "right")) {
-		pwm_right = pwm_get(&pdev->dev, NULL);
-		if (IS_ERR(pwm_right)){
+		motors[right].pwm = pwm_get(&pdev->dev, NULL);
+		if (IS_ERR(motors[right].pwm)){
 			printk("Requesting right PWM failed");
 			return -EIO;
 		}
@@ -68,11 +153,11 @@ static int my_remove(struct platform_device *pdev)
     }
 
 	if(strcmp(side, "left")){
-		pwm_disable(pwm_left);
-		pwm_put(pwm_left);
+		pwm_disable(motors[left].pwm);
+		pwm_put(motors[left].pwm);
 	} else if(strcmp(side, "right")) {
-		pwm_disable(pwm_right);
-		pwm_put(pwm_right);
+		pwm_disable(motors[right].pwm);
+		pwm_put(motors[right].pwm);
 	}
 	return 0;
 }
@@ -96,23 +181,14 @@ static struct platform_driver my_platform_driver = {
 	},
 };
 
-enum motor { left, right };
-
 static int driver_open( struct inode *geraetedatei, struct file *instanz )
 {
 	int err;
-	int motor_in1, motor_in2;
-	struct device *motor_device;
 	// Ein Treiber bedient zwei Motoren.
-	if (iminor(geraetedatei)==0) { // motor_left
-		motor_in1 = ML1;
-		motor_in2 = ML2;
-		motor_device = motorl_dev;
-	} else { // motor_right
-		motor_in1 = MR1;
-		motor_in2 = MR2;
-		motor_device = motorr_dev;
-	}
+	struct motor *motor = &motors[iminor(geraetedatei)];
+	int motor_in1 = motor->in1, motor_in2 = motor->in2;
+
+	instanz->private_data = motor;
 
 	// GPIO für motor_in1 reservieren
 	// Inklusive Fehlerbehandlung
@@ -145,99 +221,494 @@ static int driver_open( struct inode *geraetedatei, struct file *instanz )
 		return -EIO;
 	}
 
+	mutex_lock(&motor->lock);
+	motor->opened = true;
+	mutex_unlock(&motor->lock);
+
 	printk("gpio %d and  %d successfull configured\n",motor_in1,motor_in2);
 	return 0;
 }
 
-static int driver_close( struct inode *geraete_datei, struct file *instanz )
+/* Tastverhaeltnis in ns fuer einen Wert in Promille */
+static unsigned int duty_ns(struct motor *motor, int speed)
 {
-	int motor_in1, motor_in2;
-
-	if (iminor(instanz->f_inode)==0) { // motor_left
-		motor_in1 = ML1;
-		motor_in2 = ML2;
-	} else { // motor_right
-		motor_in1 = MR1;
-		motor_in2 = MR2;
-	}
-
-	printk( "driver_close called\n");
-	gpio_free( motor_in1 );
-	gpio_free( motor_in2 );
-	return 0;
+	return div_u64((u64)motor->period_ns * abs(speed), MOTOR_DUTY_MAX);
 }
 
-static int drive_motor(enum motor motor, int speed){
+/* Ausgabe in Promille, Aufruf mit motor->lock */
+static int drive_motor(struct motor *motor, int speed){
 	
-	struct pwm_device* pwm_device;
-	int motor_in1, motor_in2;
-	unsigned int period, duty_cycle;
-
-	if(motor == left){
-		pwm_device = pwm_left;
-		motor_in1 = ML1;
-		motor_in2 = ML2;
-	} else if (motor == right) {
-		pwm_device = pwm_right;
-		motor_in1 = MR1;
-		motor_in2 = MR2;
-	}
+	struct pwm_device* pwm_device = motor->pwm;
+	int motor_in1 = motor->in1, motor_in2 = motor->in2;
+
+	if (READ_ONCE(emergency_stop))
+		speed = 0;
+	speed = clamp(speed, -MOTOR_DUTY_MAX, MOTOR_DUTY_MAX);
+
+	// Nur Aenderungen an die Hardware geben, jeder Zugriff kostet Buszyklen
+	if (speed == motor->speed)
+		return 0;
+	trace_motor_drive(motor - motors, speed, motor->period_ns);
 
 	if(speed == 0){
 		gpio_set_value( motor_in1, 0 );
 		gpio_set_value( motor_in2, 0 );
 		pwm_disable(pwm_device);
+		motor->speed = 0;
 		return 0;
 	}
 
-	period = 1000000000 / PWM_FREQ; // Convert Hz to period in ns
-	duty_cycle = period / 100 * abs(speed);
-	
-	//printk("period %d duty_cycle %d\n", period, duty_cycle);
-	//printk("IN1 %d IN2 %d\n", motor_in1, motor_in2);
+	if (abs(speed) != abs(motor->speed))
+		pwm_config(pwm_device, duty_ns(motor, speed), motor->period_ns);
+
+	// Richtung nur beim Anfahren oder Vorzeichenwechsel umschalten
+	if (motor->speed == 0 || (speed > 0) != (motor->speed > 0)) {
+		if(speed > 0){
+			gpio_set_value( motor_in1, 1 );
+			gpio_set_value( motor_in2, 0 );
+		} else {
+			gpio_set_value( motor_in1, 0 );
+			gpio_set_value( motor_in2, 1 );
+		}
+	}
+
+	if (motor->speed == 0)
+		pwm_enable(pwm_device);
+	motor->speed = speed;
+	return 0;
+}
 
-	pwm_config(pwm_device, duty_cycle, period);
+/* Gemessene Geschwindigkeit in mm/s (ohne Vorzeichen) */
+static int measured_speed(struct motor *motor, u64 now)
+{
+	struct lightbarrier_state state;
 
-	if(speed > 0){
-		gpio_set_value( motor_in1, 1 );
-		gpio_set_value( motor_in2, 0 );
+	lightbarrier_read(motor->lightbarrier, &state);
+	return lightbarrier_velocity(&state, now);
+}
+
+/* Ein Reglerschritt, Aufruf mit motor->lock. */
+static void control_step(struct motor *motor, u64 now)
+{
+	int target = motor->target_mm_per_s;
+	int sign = target < 0 ? -1 : 1;
+	int measured, error, feed_forward, duty;
+	s64 output, integral_limit;
+
+	if (target == 0) {
+		drive_motor(motor, 0);
+		return;
+	}
+
+	measured = measured_speed(motor, now);
+	error = abs(target) - measured;
+	motor->integral += (s64)error * (CONTROL_PERIOD_NS / NSEC_PER_MSEC);
+
+	// Anti-Windup: Integralanteil auf +-50% begrenzen
+	if (ki) {
+		integral_limit = div_s64(50000LL * 1000, abs(ki));
+		motor->integral = clamp(motor->integral, -integral_limit, integral_limit);
+	}
+
+	// Vorsteuerung wie bisher im Userspace geschaetzt
+	feed_forward = (abs(target) / 10 + 50) * 1000;
+	output = feed_forward + (s64)kp * error
+		+ div_s64((s64)ki * motor->integral, 1000)
+		+ div_s64((s64)kd * (error - motor->previous_error) * MSEC_PER_SEC,
+			CONTROL_PERIOD_NS / NSEC_PER_MSEC);
+	motor->previous_error = error;
+
+	output = clamp_t(s64, output, 0, 100000);
+	duty = sign * (int)div_s64(output, 100);
+	trace_motor_control(motor - motors, target, measured, duty);
+	drive_motor(motor, duty);
+}
+
+/*
+ * Ein Rampenschritt Richtung ramp_target, Aufruf mit motor->lock. Ein
+ * Richtungswechsel laeuft dabei ueber 0 statt hart umzuschalten.
+ */
+static void ramp_step(struct motor *motor)
+{
+	int rate = READ_ONCE(slew_rate);
+	int step = max(1, (int)div_s64((s64)rate * 10 * CONTROL_PERIOD_NS, NSEC_PER_SEC));
+	int speed = motor->speed;
+
+	if (rate <= 0 || abs(motor->ramp_target - speed) <= step)
+		speed = motor->ramp_target;
+	else if (speed < motor->ramp_target)
+		speed += step;
+	else
+		speed -= step;
+
+	drive_motor(motor, speed);
+	if (speed == motor->ramp_target)
+		motor->ramping = false;
+}
+
+static bool motor_active(struct motor *motor)
+{
+	return READ_ONCE(motor->speed_control) || READ_ONCE(motor->ramping);
+}
+
+static bool control_active(void)
+{
+	return motor_active(&motors[left]) || motor_active(&motors[right]);
+}
+
+/*
+ * Geschwindigkeitsregler und Rampe fuer beide Motoren. Laeuft als SCHED_FIFO
+ * Kernel-Thread und schlaeft per hrtimer bis zur absoluten naechsten Periode.
+ */
+static int control_loop(void *data)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO / 2 };
+	ktime_t next = ktime_get();
+	int i;
+
+	sched_setscheduler_nocheck(current, SCHED_FIFO, &param);
+
+	while (!kthread_should_stop()) {
+		if (!control_active()) {
+			wait_event_interruptible(control_wait,
+				control_active() || kthread_should_stop());
+			next = ktime_get();
+			continue;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(motors); i++) {
+			mutex_lock(&motors[i].lock);
+			if (motors[i].speed_control)
+				control_step(&motors[i], rc_now_ns());
+			else if (motors[i].ramping)
+				ramp_step(&motors[i]);
+			mutex_unlock(&motors[i].lock);
+		}
+
+		next = ktime_add_ns(next, CONTROL_PERIOD_NS);
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+	}
+	return 0;
+}
+
+/* Wechsel in die direkte Ansteuerung, Aufruf mit motor->lock. */
+static void stop_speed_control(struct motor *motor)
+{
+	if (motor->speed_control) {
+		motor->speed_control = false;
+		lightbarrier_put(motor->lightbarrier);
+	}
+}
+
+/* Wechsel in den Geschwindigkeitsregler, Aufruf mit motor->lock. */
+static int start_speed_control(struct motor *motor)
+{
+	int err;
+
+	if (motor->speed_control)
+		return 0;
+	err = lightbarrier_get(motor->lightbarrier);
+	if (err)
+		return err;
+	motor->speed_control = true;
+	motor->ramping = false;
+	motor->target_mm_per_s = 0;
+	return 0;
+}
+
+/*
+ * Direkte Ansteuerung in Promille, Aufruf mit motor->lock. Mit Rampe wird nur
+ * das Ziel gesetzt, true heisst dann, dass der Regler-Thread geweckt werden muss.
+ */
+static bool set_direct_speed(struct motor *motor, int speed)
+{
+	stop_speed_control(motor);
+	if (READ_ONCE(slew_rate) > 0) {
+		motor->ramp_target = speed;
+		motor->ramping = speed != motor->speed;
+		return motor->ramping;
+	}
+	motor->ramping = false;
+	drive_motor(motor, speed);
+	return false;
+}
+
+/* Neue Sollgeschwindigkeit uebernehmen, Aufruf mit motor->lock und aktivem Regler. */
+static void update_speed_target(struct motor *motor, int target)
+{
+	if (target != motor->target_mm_per_s) {
+		motor->target_mm_per_s = target;
+		motor->integral = 0;
+		motor->previous_error = 0;
+	}
+}
+
+/* Sollgeschwindigkeit in mm/s setzen und den Regler einschalten. */
+static int set_speed_target(struct motor *motor, int target)
+{
+	int err;
+
+	trace_motor_set_target(motor - motors, target);
+	mutex_lock(&motor->lock);
+	err = start_speed_control(motor);
+	if (!err)
+		update_speed_target(motor, target);
+	mutex_unlock(&motor->lock);
+
+	if (!err)
+		wake_up_interruptible(&control_wait);
+	return err;
+}
+
+/*
+ * Neue PWM Frequenz. Laeuft der Motor, gibt pwm_config() das gleiche
+ * Tastverhaeltnis sofort mit der neuen Periode aus.
+ */
+static int set_pwm_freq(struct motor *motor, int freq)
+{
+	if (freq < PWM_FREQ_MIN || freq > PWM_FREQ_MAX)
+		return -EINVAL;
+
+	mutex_lock(&motor->lock);
+	motor->period_ns = NSEC_PER_SEC / freq;
+	if (motor->speed && !IS_ERR_OR_NULL(motor->pwm))
+		pwm_config(motor->pwm, duty_ns(motor, motor->speed), motor->period_ns);
+	mutex_unlock(&motor->lock);
+	return 0;
+}
+
+static ssize_t pwm_freq_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct motor *motor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", (unsigned int)(NSEC_PER_SEC / READ_ONCE(motor->period_ns)));
+}
+
+static ssize_t pwm_freq_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct motor *motor = dev_get_drvdata(dev);
+	int freq, err;
+
+	err = kstrtoint(buf, 10, &freq);
+	if (err)
+		return err;
+	err = set_pwm_freq(motor, freq);
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(pwm_freq);
+
+static struct attribute *motor_attrs[] = {
+	&dev_attr_pwm_freq.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(motor);
+
+/* Beide Motoren sperren, immer links vor rechts. */
+static void lock_pair(void)
+{
+	mutex_lock(&motors[left].lock);
+	mutex_lock_nested(&motors[right].lock, SINGLE_DEPTH_NESTING);
+}
+
+static void unlock_pair(void)
+{
+	mutex_unlock(&motors[right].lock);
+	mutex_unlock(&motors[left].lock);
+}
+
+/*
+ * Beide Motoren in einem kritischen Abschnitt ansteuern. Weder der
+ * Regler-Thread noch ein write() sieht einen Zustand, in dem nur ein
+ * Motor den neuen Wert hat. Direkte Werte in Promille.
+ */
+static int set_pair(const struct motor_pair *pair, bool speed_target)
+{
+	bool was_controlled, wake = false;
+	int err = 0;
+
+	trace_motor_set_pair(pair->left, pair->right, speed_target);
+	lock_pair();
+	if (!motors[left].opened || !motors[right].opened) {
+		err = -ENODEV;
+		goto unlock;
+	}
+
+	if (speed_target) {
+		was_controlled = motors[left].speed_control;
+		err = start_speed_control(&motors[left]);
+		if (err)
+			goto unlock;
+		err = start_speed_control(&motors[right]);
+		if (err) {
+			if (!was_controlled)
+				stop_speed_control(&motors[left]);
+			goto unlock;
+		}
+		update_speed_target(&motors[left], pair->left);
+		update_speed_target(&motors[right], pair->right);
+		wake = true;
 	} else {
-		gpio_set_value( motor_in1, 0 );
-		gpio_set_value( motor_in2, 1 );
+		wake = set_direct_speed(&motors[left], pair->left);
+		wake |= set_direct_speed(&motors[right], pair->right);
 	}
+unlock:
+	unlock_pair();
+
+	if (wake)
+		wake_up_interruptible(&control_wait);
+	return err;
+}
 
-	pwm_enable(pwm_device);
+/*
+ * Schaltet H-Bruecke und PWM ab, egal was motor->speed sagt, und beendet
+ * Regler und Rampe, damit der Regler-Thread schlafen geht. Aufruf mit motor->lock.
+ */
+static void force_off(struct motor *motor)
+{
+	stop_speed_control(motor);
+	motor->ramping = false;
+	trace_motor_drive(motor - motors, 0, motor->period_ns);
+	if (motor->opened) {
+		gpio_set_value(motor->in1, 0);
+		gpio_set_value(motor->in2, 0);
+	}
+	if (!IS_ERR_OR_NULL(motor->pwm))
+		pwm_disable(motor->pwm);
+	motor->speed = 0;
+}
+
+/*
+ * Der Stopp wird verriegelt, bevor die Locks genommen werden: Ein Reglerschritt
+ * oder write(), das gerade auf das Lock wartet, gibt danach in drive_motor()
+ * nur noch 0 aus. Unter den Locks laeuft kein anderer Schreiber, force_off()
+ * kann also nicht mehr ueberschrieben werden. Die Locks werden nur fuer
+ * wenige Registerzugriffe gehalten.
+ */
+void motor_emergency_stop(void)
+{
+	int i;
+
+	WRITE_ONCE(emergency_stop, true);
+	lock_pair();
+	for (i = 0; i < ARRAY_SIZE(motors); i++)
+		force_off(&motors[i]);
+	unlock_pair();
+}
+EXPORT_SYMBOL(motor_emergency_stop);
+
+void motor_emergency_release(void)
+{
+	WRITE_ONCE(emergency_stop, false);
+}
+EXPORT_SYMBOL(motor_emergency_release);
+
+static int driver_close( struct inode *geraete_datei, struct file *instanz )
+{
+	struct motor *motor = instanz->private_data;
+
+	mutex_lock(&motor->lock);
+	stop_speed_control(motor);
+	motor->ramping = false;
+	drive_motor(motor, 0);
+	motor->opened = false;
+	mutex_unlock(&motor->lock);
+
+	printk( "driver_close called\n");
+	gpio_free( motor->in1 );
+	gpio_free( motor->in2 );
 	return 0;
 }
 
 static ssize_t driver_write( struct file *instanz, const char __user *user,
 		size_t count, loff_t *offset )
 {
+	struct motor *motor = instanz->private_data;
 	unsigned long not_copied, to_copy;
 	int value=0;
+	bool wake;
 
 	to_copy = min( count, sizeof(value) );
 	not_copied=copy_from_user(&value, user, to_copy);
-	//dev_info( motorl_dev, "driver_write: value %x\n", value );
+	trace_motor_write(motor - motors, value);
 
-	if (iminor(instanz->f_inode)==0) { // motor_left
-		drive_motor(left, value);
-	} else { // motor_right
-		drive_motor(right, value);
-	}
+	// Direkte Ansteuerung in % beendet den Geschwindigkeitsregler
+	mutex_lock(&motor->lock);
+	wake = set_direct_speed(motor, clamp(value, -100, 100) * 10);
+	mutex_unlock(&motor->lock);
+	if (wake)
+		wake_up_interruptible(&control_wait);
 
 	return to_copy-not_copied;
 }
 
+/* Direktes Tastverhaeltnis in Promille fuer einen Motor */
+static int set_duty(struct motor *motor, int duty)
+{
+	bool wake;
+
+	trace_motor_set_duty(motor - motors, duty);
+	mutex_lock(&motor->lock);
+	wake = set_direct_speed(motor, duty);
+	mutex_unlock(&motor->lock);
+	if (wake)
+		wake_up_interruptible(&control_wait);
+	return 0;
+}
+
+static long driver_ioctl( struct file *instanz, unsigned int cmd, unsigned long arg )
+{
+	struct motor *motor = instanz->private_data;
+	struct motor_pair pair;
+	int value;
+
+	switch (cmd) {
+	case MOTOR_IOC_SET_SPEED_TARGET:
+		if (get_user(value, (int __user *)arg))
+			return -EFAULT;
+		return set_speed_target(motor, value);
+	case MOTOR_IOC_SET_DUTY:
+		if (get_user(value, (int __user *)arg))
+			return -EFAULT;
+		if (abs(value) > MOTOR_DUTY_MAX)
+			return -EINVAL;
+		return set_duty(motor, value);
+	case MOTOR_IOC_SET_PWM_FREQ:
+		if (get_user(value, (int __user *)arg))
+			return -EFAULT;
+		return set_pwm_freq(motor, value);
+	case MOTOR_IOC_SET_PAIR_SPEED:
+	case MOTOR_IOC_SET_PAIR_TARGET:
+	case MOTOR_IOC_SET_PAIR_DUTY:
+		if (copy_from_user(&pair, (void __user *)arg, sizeof(pair)))
+			return -EFAULT;
+		if (cmd == MOTOR_IOC_SET_PAIR_SPEED) {
+			pair.left = clamp(pair.left, -100, 100) * 10;
+			pair.right = clamp(pair.right, -100, 100) * 10;
+		} else if (cmd == MOTOR_IOC_SET_PAIR_DUTY &&
+				(abs(pair.left) > MOTOR_DUTY_MAX || abs(pair.right) > MOTOR_DUTY_MAX)) {
+			return -EINVAL;
+		}
+		return set_pair(&pair, cmd == MOTOR_IOC_SET_PAIR_TARGET);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static struct file_operations fops = {
 	.owner= THIS_MODULE,
 	.write= driver_write,
+	.unlocked_ioctl= driver_ioctl,
 	.open= driver_open,
 	.release= driver_close,
 };
 
 static int __init mod_init( void )
 {
+	int i, err = -EIO;
+
 	if( alloc_chrdev_region(&gpio_dev_number,0,2,"motor")<0 )
 		return -EIO;
 	driver_object = cdev_alloc(); /* Anmeldeobjekt reservieren */
@@ -253,23 +724,48 @@ static int __init mod_init( void )
 		pr_err( "gpio: no udev support\n");
 		goto free_cdev;
 	}
-	motorl_dev = device_create( gpio_class, NULL, gpio_dev_number,
-		NULL, "%s", "motor-left" );
-	motorr_dev = device_create( gpio_class, NULL, gpio_dev_number+1,
-		NULL, "%s", "motor-right" );
+	if (pwm_freq < PWM_FREQ_MIN || pwm_freq > PWM_FREQ_MAX) {
+		pr_err( "motor: pwm_freq %d out of range\n", pwm_freq);
+		pwm_freq = clamp(pwm_freq, PWM_FREQ_MIN, PWM_FREQ_MAX);
+	}
+	for (i = 0; i < ARRAY_SIZE(motors); i++) {
+		mutex_init(&motors[i].lock);
+		motors[i].period_ns = NSEC_PER_SEC / pwm_freq;
+		motors[i].dev = device_create_with_groups( gpio_class, NULL,
+			gpio_dev_number + i, &motors[i], motor_groups, "%s", motors[i].name );
+	}
+
+	control_thread = kthread_run(control_loop, NULL, "motor_control");
+	if (IS_ERR(control_thread)) {
+		pr_err( "motor: can't start control thread\n");
+		goto free_devices;
+	}
+
+	err = platform_driver_register(&my_platform_driver);
+	if (err) {
+		pr_err( "motor: can't register platform driver\n");
+		goto stop_thread;
+	}
 
-	dev_info(motorl_dev, "mod_init");
-	return platform_driver_register(&my_platform_driver);
+	dev_info(motors[left].dev, "mod_init");
+	return 0;
+stop_thread:
+	kthread_stop(control_thread);
+free_devices:
+	device_destroy( gpio_class, gpio_dev_number+1 );
+	device_destroy( gpio_class, gpio_dev_number );
+	class_destroy( gpio_class );
 free_cdev:
 	kobject_put( &driver_object->kobj );
 free_device_number:
 	unregister_chrdev_region( gpio_dev_number, 2 );
-	return -EIO;
+	return err;
 }
 
 static void __exit mod_exit( void )
 {
-	dev_info(motorl_dev, "mod_exit");
+	dev_info(motors[left].dev, "mod_exit");
+	kthread_stop(control_thread);
 	platform_driver_unregister(&my_platform_driver);
 	/* Loeschen des Sysfs-Eintrags und damit der Geraetedatei */
 	device_destroy( gpio_class, gpio_dev_number+1 );
@@ -0,0 +1,45 @@
+#ifndef MOTOR_H
+#define MOTOR_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MOTOR_IOC_MAGIC 'm'
+
+/* Sollgeschwindigkeit in mm/s (int), schaltet den Geschwindigkeitsregler ein.
+ * Ein write() mit direktem PWM Wert schaltet ihn wieder aus. */
+#define MOTOR_IOC_SET_SPEED_TARGET _IOW(MOTOR_IOC_MAGIC, 1, int)
+
+/* Werte fuer beide Motoren, gesetzt in einem Schritt ohne Zwischenzustand.
+ * Beide Geraetedateien muessen geoeffnet sein, die Befehle gehen ueber eine davon. */
+struct motor_pair {
+	__s32 left;
+	__s32 right;
+};
+
+/* Direkter PWM Wert in % je Motor, beendet den Geschwindigkeitsregler */
+#define MOTOR_IOC_SET_PAIR_SPEED _IOW(MOTOR_IOC_MAGIC, 2, struct motor_pair)
+/* Sollgeschwindigkeit in mm/s je Motor, schaltet den Geschwindigkeitsregler ein */
+#define MOTOR_IOC_SET_PAIR_TARGET _IOW(MOTOR_IOC_MAGIC, 3, struct motor_pair)
+
+/* Tastverhaeltnis in Promille, -MOTOR_DUTY_MAX bis MOTOR_DUTY_MAX */
+#define MOTOR_DUTY_MAX 1000
+
+/* Direktes Tastverhaeltnis in Promille (int), beendet den Geschwindigkeitsregler */
+#define MOTOR_IOC_SET_DUTY _IOW(MOTOR_IOC_MAGIC, 4, int)
+/* Direktes Tastverhaeltnis in Promille je Motor */
+#define MOTOR_IOC_SET_PAIR_DUTY _IOW(MOTOR_IOC_MAGIC, 5, struct motor_pair)
+/* PWM Frequenz des Motors in Hz (int), gilt ab sofort auch fuer eine laufende Ausgabe */
+#define MOTOR_IOC_SET_PWM_FREQ _IOW(MOTOR_IOC_MAGIC, 6, int)
+
+/*
+ * Not-Aus fuer andere Treiber. motor_emergency_stop() schaltet PWM und
+ * H-Bruecke beider Motoren sofort ab und haelt sie aus, bis
+ * motor_emergency_release() aufgerufen wird; bis dahin werden alle Befehle
+ * aus dem Userspace als 0 ausgefuehrt. Aufruf im Prozesskontext oder aus
+ * einem Thread-Handler, nicht im harten Interrupt.
+ */
+void motor_emergency_stop(void);
+void motor_emergency_release(void);
+
+#endif
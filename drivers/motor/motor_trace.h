@@ -0,0 +1,123 @@
+/*
+ * Tracepoints des Motor-Treibers (events/motor/ im Tracing-Verzeichnis).
+ * Zusammen mit den Sensor-Treibern zeigen sie die ganze Kette von der Flanke
+ * bis zur neuen PWM Ausgabe. Abgeschaltet kosten sie nur einen nicht
+ * genommenen Sprung.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM motor
+
+#if !defined(_MOTOR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MOTOR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Befehl aus dem Userspace an einen Motor, motor 0 = links */
+DECLARE_EVENT_CLASS(motor_command,
+	TP_PROTO(int motor, int value),
+	TP_ARGS(motor, value),
+
+	TP_STRUCT__entry(
+		__field(int, motor)
+		__field(int, value)
+	),
+
+	TP_fast_assign(
+		__entry->motor = motor;
+		__entry->value = value;
+	),
+
+	TP_printk("motor=%s value=%d", __entry->motor ? "right" : "left", __entry->value)
+);
+
+/* write() mit direktem Wert in % */
+DEFINE_EVENT(motor_command, motor_write,
+	TP_PROTO(int motor, int value),
+	TP_ARGS(motor, value)
+);
+
+/* MOTOR_IOC_SET_DUTY in Promille */
+DEFINE_EVENT(motor_command, motor_set_duty,
+	TP_PROTO(int motor, int value),
+	TP_ARGS(motor, value)
+);
+
+/* MOTOR_IOC_SET_SPEED_TARGET in mm/s */
+DEFINE_EVENT(motor_command, motor_set_target,
+	TP_PROTO(int motor, int value),
+	TP_ARGS(motor, value)
+);
+
+/* Befehl fuer beide Motoren, Promille oder mit speed_target mm/s */
+TRACE_EVENT(motor_set_pair,
+	TP_PROTO(int left, int right, bool speed_target),
+	TP_ARGS(left, right, speed_target),
+
+	TP_STRUCT__entry(
+		__field(int, left)
+		__field(int, right)
+		__field(bool, speed_target)
+	),
+
+	TP_fast_assign(
+		__entry->left = left;
+		__entry->right = right;
+		__entry->speed_target = speed_target;
+	),
+
+	TP_printk("left=%d right=%d %s", __entry->left, __entry->right,
+		__entry->speed_target ? "mm/s" : "permille")
+);
+
+/* Ein Schritt des Geschwindigkeitsreglers, output in Promille */
+TRACE_EVENT(motor_control,
+	TP_PROTO(int motor, int target, int measured, int output),
+	TP_ARGS(motor, target, measured, output),
+
+	TP_STRUCT__entry(
+		__field(int, motor)
+		__field(int, target)
+		__field(int, measured)
+		__field(int, output)
+	),
+
+	TP_fast_assign(
+		__entry->motor = motor;
+		__entry->target = target;
+		__entry->measured = measured;
+		__entry->output = output;
+	),
+
+	TP_printk("motor=%s target=%d measured=%d output=%d",
+		__entry->motor ? "right" : "left", __entry->target,
+		__entry->measured, __entry->output)
+);
+
+/* Neuer Wert an der Hardware, nur bei einer Aenderung */
+TRACE_EVENT(motor_drive,
+	TP_PROTO(int motor, int duty, unsigned int period_ns),
+	TP_ARGS(motor, duty, period_ns),
+
+	TP_STRUCT__entry(
+		__field(int, motor)
+		__field(int, duty)
+		__field(unsigned int, period_ns)
+	),
+
+	TP_fast_assign(
+		__entry->motor = motor;
+		__entry->duty = duty;
+		__entry->period_ns = period_ns;
+	),
+
+	TP_printk("motor=%s duty=%d period_ns=%u", __entry->motor ? "right" : "left",
+		__entry->duty, __entry->period_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE motor_trace
+#include <trace/define_trace.h>
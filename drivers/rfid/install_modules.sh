@@ -0,0 +1,18 @@
+#!/bin/sh
+
+if [ $# -eq 1 ]
+  then
+    echo "Compiling and Installing to " $1
+    make
+    echo "Removing existing module"
+    ssh root@$1 'rmmod rfid'
+    echo "Copying module"
+    scp configure_rfid.dtb root@$1:/boot/overlays/
+    scp rfid.ko root@$1:
+    echo "Installing module"
+    # crc_ccitt() kommt aus dem crc-ccitt Modul
+    ssh root@$1 'modprobe crc-ccitt; insmod /root/rfid.ko'
+  else
+    echo "./build.sh <IP_OF_RASPBERRY>"
+fi
+
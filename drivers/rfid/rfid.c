@@ -0,0 +1,570 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <asm/uaccess.h>
+#include <linux/uaccess.h>
+#include <linux/interrupt.h>
+#include <linux/spi/spi.h>
+#include <linux/gpio/consumer.h>
+#include <linux/of.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/crc-ccitt.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include "rc_core.h"
+#include "rfid.h"
+
+static dev_t rfid_dev_number;
+static struct cdev *driver_object;
+static struct class *rfid_class;
+static struct device *rfid_dev;
+
+// Register des MFRC522
+#define REG_COMMAND	0x01
+#define REG_COM_IEN	0x02
+#define REG_DIV_IEN	0x03
+#define REG_COM_IRQ	0x04
+#define REG_ERROR	0x06
+#define REG_FIFO_DATA	0x09
+#define REG_FIFO_LEVEL	0x0A
+#define REG_BIT_FRAMING	0x0D
+#define REG_MODE	0x11
+#define REG_TX_CONTROL	0x14
+#define REG_TX_ASK	0x15
+#define REG_T_MODE	0x2A
+#define REG_T_PRESCALER	0x2B
+#define REG_T_RELOAD_H	0x2C
+#define REG_T_RELOAD_L	0x2D
+#define REG_VERSION	0x37
+
+#define CMD_IDLE	0x00
+#define CMD_TRANSCEIVE	0x0C
+#define CMD_SOFT_RESET	0x0F
+
+// Bits in ComIEnReg/ComIrqReg
+#define IRQ_INV		0x80
+#define IRQ_RX		0x20
+#define IRQ_ERR		0x02
+#define IRQ_TIMER	0x01
+#define IRQ_PUSH_PULL	0x80	/* in DivIEnReg */
+
+// Bits in ErrorReg
+#define ERR_COLL	0x08
+#define ERR_FATAL	0x13	/* BufferOvfl, ParityErr, ProtocolErr */
+
+// Befehle an die Karte (ISO 14443-3)
+#define PICC_REQA	0x26
+#define PICC_SEL_CL1	0x93
+#define PICC_HLTA	0x50
+#define CASCADE_TAG	0x88
+#define SAK_UID_INCOMPLETE 0x04
+
+// Antwortet die Karte nicht, meldet der Timer des Chips nach 5 ms (200 * 25 us)
+#define CARD_TIMEOUT_TICKS 200
+// Sicherheitsnetz, falls der Interrupt ausbleibt
+#define IRQ_TIMEOUT_MS 20
+
+#define EVENT_FIFO_SIZE 8
+#define SPI_BUFFER_SIZE 32
+
+static int poll_ms = 20;
+module_param(poll_ms, int, 0644);
+MODULE_PARM_DESC(poll_ms, "Abstand der Kartensuche in ms");
+
+struct rfid {
+	struct spi_device *spi;
+	struct gpio_desc *reset;
+	u8 *buffer;			/* DMA-faehiger Puffer fuer die SPI Transfers */
+	struct completion irq_done;
+	u64 irq_ns;			/* Zeitstempel des letzten Interrupts */
+	struct task_struct *thread;	/* nur waehrend geoeffnet und gebunden */
+	struct mutex users_lock;	/* serialisiert open()/close()/remove() */
+	struct mutex read_lock;		/* Leseseite des Ringpuffers */
+	bool opened;
+	bool overflow;
+	DECLARE_RC_RING(events, struct rfid_event, EVENT_FIFO_SIZE);
+	wait_queue_head_t wait;
+};
+
+static struct rfid reader;
+
+static int write_reg(struct rfid *rfid, u8 reg, u8 value)
+{
+	rfid->buffer[0] = (reg << 1) & 0x7e;
+	rfid->buffer[1] = value;
+	return spi_write(rfid->spi, rfid->buffer, 2);
+}
+
+static int read_reg(struct rfid *rfid, u8 reg, u8 *value)
+{
+	u8 address = ((reg << 1) & 0x7e) | 0x80;
+
+	return spi_write_then_read(rfid->spi, &address, 1, value, 1);
+}
+
+static int write_fifo(struct rfid *rfid, const u8 *data, int len)
+{
+	rfid->buffer[0] = (REG_FIFO_DATA << 1) & 0x7e;
+	memcpy(rfid->buffer + 1, data, len);
+	return spi_write(rfid->spi, rfid->buffer, len + 1);
+}
+
+/* Liest len Byte aus dem FIFO in einem Transfer: Adresse len mal senden, dann 0. */
+static int read_fifo(struct rfid *rfid, u8 *data, int len)
+{
+	struct spi_transfer transfer = {
+		.tx_buf = rfid->buffer,
+		.rx_buf = rfid->buffer + SPI_BUFFER_SIZE / 2,
+		.len = len + 1,
+	};
+	int err;
+
+	memset(rfid->buffer, ((REG_FIFO_DATA << 1) & 0x7e) | 0x80, len);
+	rfid->buffer[len] = 0;
+	err = spi_sync_transfer(rfid->spi, &transfer, 1);
+	if (!err)
+		memcpy(data, rfid->buffer + SPI_BUFFER_SIZE / 2 + 1, len);
+	return err;
+}
+
+static irqreturn_t intr_handler(int irq, void *dev_id)
+{
+	struct rfid *rfid = dev_id;
+
+	rfid->irq_ns = rc_now_ns();
+	complete(&rfid->irq_done);
+	return IRQ_HANDLED;
+}
+
+/*
+ * Sendet len Byte an die Karte und schlaeft, bis der Chip per Interrupt
+ * eine Antwort, einen Fehler oder den Ablauf seines Timers meldet. Das
+ * Statusregister wird also nicht per SPI abgefragt, solange nichts passiert.
+ * Liefert die Anzahl empfangener Byte, -ETIMEDOUT wenn keine Karte antwortet.
+ */
+static int transceive(struct rfid *rfid, const u8 *data, int len, u8 bit_framing,
+	u8 *response, int max)
+{
+	u8 irq, error, level;
+	int err;
+
+	if (len > SPI_BUFFER_SIZE / 2 - 1 || max > SPI_BUFFER_SIZE / 2 - 1)
+		return -EINVAL;
+
+	err = write_reg(rfid, REG_COMMAND, CMD_IDLE);
+	err = err ?: write_reg(rfid, REG_COM_IRQ, 0x7f);
+	err = err ?: write_reg(rfid, REG_FIFO_LEVEL, 0x80);
+	err = err ?: write_fifo(rfid, data, len);
+	err = err ?: write_reg(rfid, REG_BIT_FRAMING, bit_framing);
+	if (err)
+		return err;
+
+	reinit_completion(&rfid->irq_done);
+	err = write_reg(rfid, REG_COMMAND, CMD_TRANSCEIVE);
+	err = err ?: write_reg(rfid, REG_BIT_FRAMING, bit_framing | 0x80); /* StartSend */
+	if (err)
+		return err;
+	if (!wait_for_completion_timeout(&rfid->irq_done, msecs_to_jiffies(IRQ_TIMEOUT_MS)))
+		dev_warn_ratelimited(rfid_dev, "no interrupt from the reader\n");
+
+	err = read_reg(rfid, REG_COM_IRQ, &irq);
+	err = err ?: write_reg(rfid, REG_COM_IRQ, 0x7f);
+	err = err ?: write_reg(rfid, REG_COMMAND, CMD_IDLE);
+	if (err)
+		return err;
+	if (!(irq & (IRQ_RX | IRQ_ERR)))
+		return -ETIMEDOUT;
+
+	err = read_reg(rfid, REG_ERROR, &error);
+	if (err)
+		return err;
+	// Kollisionen werden nicht aufgeloest, beim naechsten Durchlauf neu versuchen
+	if (error & (ERR_FATAL | ERR_COLL))
+		return -EIO;
+
+	err = read_reg(rfid, REG_FIFO_LEVEL, &level);
+	if (err)
+		return err;
+	level = min_t(int, level & 0x7f, max);
+	err = read_fifo(rfid, response, level);
+	return err ?: level;
+}
+
+/* CRC_A nach ISO 14443-3 an die ersten len Byte anhaengen */
+static void append_crc(u8 *data, int len)
+{
+	u16 crc = crc_ccitt(0x6363, data, len);
+
+	data[len] = crc & 0xff;
+	data[len + 1] = crc >> 8;
+}
+
+/*
+ * Sucht eine Karte im Feld: REQA, Antikollision und SELECT ueber alle
+ * Kaskadenstufen, danach HLTA. Eine angehaltene Karte antwortet erst
+ * wieder auf REQA, wenn sie das Feld verlassen hat; so entsteht pro
+ * Karte genau ein Ereignis.
+ */
+static int detect_card(struct rfid *rfid, struct rfid_event *event)
+{
+	u8 command[9], answer[5], sak[3];
+	u64 timestamp;
+	int level, n;
+
+	command[0] = PICC_REQA;
+	n = transceive(rfid, command, 1, 0x07, answer, 2);
+	if (n < 0)
+		return n;
+	if (n != 2)
+		return -EIO;
+	timestamp = rfid->irq_ns;
+
+	for (level = 0; level < 3; level++) {
+		command[0] = PICC_SEL_CL1 + 2 * level;
+		command[1] = 0x20;
+		n = transceive(rfid, command, 2, 0x00, answer, 5);
+		if (n < 0)
+			return n;
+		if (n != 5 || (answer[0] ^ answer[1] ^ answer[2] ^ answer[3]) != answer[4])
+			return -EIO;
+
+		command[1] = 0x70;
+		memcpy(command + 2, answer, 5);
+		append_crc(command, 7);
+		n = transceive(rfid, command, 9, 0x00, sak, 3);
+		if (n < 0)
+			return n;
+		if (n != 3 || crc_ccitt(0x6363, sak, 3) != 0)
+			return -EIO;
+
+		if (answer[0] == CASCADE_TAG) {
+			memcpy(event->uid + event->uid_size, answer + 1, 3);
+			event->uid_size += 3;
+		} else {
+			memcpy(event->uid + event->uid_size, answer, 4);
+			event->uid_size += 4;
+		}
+		if (!(sak[0] & SAK_UID_INCOMPLETE))
+			break;
+	}
+	if (level == 3)
+		return -EIO;
+
+	event->sak = sak[0];
+	event->timestamp_ns = timestamp;
+
+	// Auf HLTA antwortet die Karte nicht, das Timeout ist hier der Erfolg
+	command[0] = PICC_HLTA;
+	command[1] = 0x00;
+	append_crc(command, 2);
+	transceive(rfid, command, 4, 0x00, answer, 1);
+	return 0;
+}
+
+static void publish_event(struct rfid *rfid, struct rfid_event *event)
+{
+	if (rfid->overflow)
+		event->flags |= RFID_EVENT_OVERFLOW;
+	rfid->overflow = !rc_ring_put(&rfid->events, event);
+	wake_up_interruptible(&rfid->wait);
+}
+
+/*
+ * Kartensuche als normaler Kernel-Thread (kein Realzeit-Thread): er
+ * schlaeft waehrend der SPI Transfers und waehrend der Chip auf die Karte
+ * wartet. Der Userspace wird nur bei einer neuen Karte geweckt.
+ */
+static int poll_loop(void *data)
+{
+	struct rfid *rfid = data;
+	struct rfid_event event;
+
+	while (!kthread_should_stop()) {
+		memset(&event, 0, sizeof(event));
+		if (!detect_card(rfid, &event))
+			publish_event(rfid, &event);
+		schedule_timeout_interruptible(msecs_to_jiffies(max(poll_ms, 1)));
+	}
+	return 0;
+}
+
+static int init_chip(struct rfid *rfid)
+{
+	u8 version;
+	int err;
+
+	err = write_reg(rfid, REG_COMMAND, CMD_SOFT_RESET);
+	if (err)
+		return err;
+	msleep(50);
+
+	err = read_reg(rfid, REG_VERSION, &version);
+	if (err)
+		return err;
+	if (version != 0x91 && version != 0x92) {
+		dev_err(rfid_dev, "unknown MFRC522 version %#x\n", version);
+		return -ENODEV;
+	}
+
+	// Timer startet nach dem Senden automatisch, 25 us pro Takt
+	err = write_reg(rfid, REG_T_MODE, 0x80);
+	err = err ?: write_reg(rfid, REG_T_PRESCALER, 0xA9);
+	err = err ?: write_reg(rfid, REG_T_RELOAD_H, CARD_TIMEOUT_TICKS >> 8);
+	err = err ?: write_reg(rfid, REG_T_RELOAD_L, CARD_TIMEOUT_TICKS & 0xff);
+	err = err ?: write_reg(rfid, REG_TX_ASK, 0x40);	/* 100% ASK */
+	err = err ?: write_reg(rfid, REG_MODE, 0x3D);	/* CRC Startwert 0x6363 */
+	// IRQ Pin: low aktiv, push-pull, fuer Empfang, Fehler und Timer
+	err = err ?: write_reg(rfid, REG_COM_IEN, IRQ_INV | IRQ_RX | IRQ_ERR | IRQ_TIMER);
+	err = err ?: write_reg(rfid, REG_DIV_IEN, IRQ_PUSH_PULL);
+	err = err ?: write_reg(rfid, REG_COM_IRQ, 0x7f);
+	err = err ?: write_reg(rfid, REG_TX_CONTROL, 0x83);	/* Antenne an */
+	return err;
+}
+
+static bool event_available(struct rfid *rfid)
+{
+	return !rc_ring_empty(&rfid->events);
+}
+
+static int driver_open( struct inode *geraetedatei, struct file *instanz )
+{
+	struct rfid *rfid = &reader;
+	int err;
+
+	mutex_lock(&rfid->users_lock);
+	if (!rfid->spi) {
+		err = -ENODEV;
+		goto unlock;
+	}
+	if (rfid->opened) {
+		err = -EBUSY;
+		goto unlock;
+	}
+	err = init_chip(rfid);
+	if (err)
+		goto unlock;
+
+	rc_ring_reset(&rfid->events);
+	rfid->overflow = false;
+	rfid->thread = kthread_run(poll_loop, rfid, "rfid_poll");
+	if (IS_ERR(rfid->thread)) {
+		err = PTR_ERR(rfid->thread);
+		rfid->thread = NULL;
+		goto unlock;
+	}
+	rfid->opened = true;
+	instanz->private_data = rfid;
+unlock:
+	mutex_unlock(&rfid->users_lock);
+	return err;
+}
+
+static int driver_close( struct inode *geraete_datei, struct file *instanz )
+{
+	struct rfid *rfid = instanz->private_data;
+
+	mutex_lock(&rfid->users_lock);
+	// Nach my_remove() laeuft der Thread schon nicht mehr
+	if (rfid->thread) {
+		kthread_stop(rfid->thread);
+		rfid->thread = NULL;
+		write_reg(rfid, REG_TX_CONTROL, 0x80);	/* Antenne aus */
+	}
+	rfid->opened = false;
+	mutex_unlock(&rfid->users_lock);
+	return 0;
+}
+
+static bool device_gone(struct rfid *rfid)
+{
+	return !READ_ONCE(rfid->spi);
+}
+
+/*
+ * Blockiert bis zur naechsten Karte, liefert ganze struct rfid_event.
+ * Wurde der Leser inzwischen entfernt, kommt keine Karte mehr: -ENODEV.
+ */
+static ssize_t driver_read( struct file *instanz, char __user *user,
+	size_t count, loff_t *offset )
+{
+	struct rfid *rfid = instanz->private_data;
+	ssize_t copied;
+
+	if (count < sizeof(struct rfid_event))
+		return -EINVAL;
+
+	if (instanz->f_flags & O_NONBLOCK) {
+		if (!event_available(rfid))
+			return device_gone(rfid) ? -ENODEV : -EAGAIN;
+	} else if (wait_event_interruptible(rfid->wait,
+			event_available(rfid) || device_gone(rfid))) {
+		return -ERESTARTSYS;
+	}
+
+	if (mutex_lock_interruptible(&rfid->read_lock))
+		return -ERESTARTSYS;
+	copied = rc_ring_to_user(&rfid->events, user, count);
+	mutex_unlock(&rfid->read_lock);
+
+	if (copied == 0 && device_gone(rfid))
+		return -ENODEV;
+	return copied;
+}
+
+static unsigned int driver_poll( struct file *instanz, poll_table *wait )
+{
+	struct rfid *rfid = instanz->private_data;
+
+	poll_wait(instanz, &rfid->wait, wait);
+	if (event_available(rfid))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static struct file_operations fops = {
+	.owner= THIS_MODULE,
+	.read = driver_read,
+	.poll = driver_poll,
+	.open= driver_open,
+	.release= driver_close,
+};
+
+static int my_probe(struct spi_device *spi)
+{
+	struct rfid *rfid = &reader;
+	int err;
+
+	rfid->buffer = devm_kzalloc(&spi->dev, SPI_BUFFER_SIZE, GFP_KERNEL);
+	if (!rfid->buffer)
+		return -ENOMEM;
+
+	rfid->reset = devm_gpiod_get_optional(&spi->dev, "reset", GPIOD_OUT_HIGH);
+	if (IS_ERR(rfid->reset)) {
+		dev_err(&spi->dev, "Requesting reset GPIO failed\n");
+		return PTR_ERR(rfid->reset);
+	}
+
+	spi->mode = SPI_MODE_0;
+	spi->bits_per_word = 8;
+	err = spi_setup(spi);
+	if (err)
+		return err;
+
+	if (spi->irq <= 0) {
+		dev_err(&spi->dev, "No interrupt configured\n");
+		return -EINVAL;
+	}
+	err = devm_request_irq(&spi->dev, spi->irq, intr_handler, IRQF_TRIGGER_FALLING,
+		"rfid", rfid);
+	if (err)
+		return err;
+
+	mutex_lock(&rfid->users_lock);
+	rfid->spi = spi;
+	mutex_unlock(&rfid->users_lock);
+	dev_info(&spi->dev, "MFRC522 at %u Hz, irq %d\n", spi->max_speed_hz, spi->irq);
+	return 0;
+}
+
+/*
+ * Nur der Such-Thread und open()/close() unter users_lock greifen auf den SPI
+ * Bus zu. kthread_stop() wartet, bis ein laufender Transfer fertig ist, erst
+ * danach wird spi geloescht. Blockierte Leser bekommen -ENODEV.
+ */
+static int my_remove(struct spi_device *spi)
+{
+	struct rfid *rfid = &reader;
+
+	mutex_lock(&rfid->users_lock);
+	if (rfid->thread) {
+		kthread_stop(rfid->thread);
+		rfid->thread = NULL;
+		write_reg(rfid, REG_TX_CONTROL, 0x80);	/* Antenne aus */
+	}
+	WRITE_ONCE(rfid->spi, NULL);
+	mutex_unlock(&rfid->users_lock);
+	wake_up_interruptible(&rfid->wait);
+	return 0;
+}
+
+static struct of_device_id my_match_table[] = {
+     {
+             .compatible = "mfrc522",
+     },
+	 {},
+};
+MODULE_DEVICE_TABLE(of, my_match_table);
+
+static struct spi_driver my_spi_driver = {
+	.probe = my_probe,
+	.remove = my_remove,
+	.driver = {
+		.name = "rfid",
+		.owner = THIS_MODULE,
+		.of_match_table = of_match_ptr(my_match_table),
+	},
+};
+
+static int __init mod_init( void )
+{
+	mutex_init(&reader.users_lock);
+	mutex_init(&reader.read_lock);
+	init_completion(&reader.irq_done);
+	INIT_RC_RING(reader.events);
+	init_waitqueue_head(&reader.wait);
+
+	if( alloc_chrdev_region(&rfid_dev_number,0,1,"rfid")<0 )
+		return -EIO;
+	driver_object = cdev_alloc(); /* Anmeldeobjekt reservieren */
+	if( driver_object==NULL )
+		goto free_device_number;
+	driver_object->owner = THIS_MODULE;
+	driver_object->ops = &fops;
+	if( cdev_add(driver_object,rfid_dev_number,1) )
+		goto free_cdev;
+	/* Eintrag im Sysfs, damit Udev den Geraetedateieintrag erzeugt. */
+	rfid_class = class_create( THIS_MODULE, "rfid" );
+	if( IS_ERR( rfid_class ) ) {
+		pr_err( "rfid: no udev support\n");
+		goto free_cdev;
+	}
+	rfid_dev = device_create( rfid_class, NULL, rfid_dev_number, NULL, "%s", "rfid" );
+
+	if( spi_register_driver(&my_spi_driver) )
+		goto free_device;
+
+	dev_info(rfid_dev, "mod_init");
+	return 0;
+free_device:
+	device_destroy( rfid_class, rfid_dev_number );
+	class_destroy( rfid_class );
+free_cdev:
+	kobject_put( &driver_object->kobj );
+free_device_number:
+	unregister_chrdev_region( rfid_dev_number, 1 );
+	return -EIO;
+}
+
+static void __exit mod_exit( void )
+{
+	dev_info(rfid_dev, "mod_exit");
+	spi_unregister_driver(&my_spi_driver);
+	/* Loeschen des Sysfs-Eintrags und damit der Geraetedatei */
+	device_destroy( rfid_class, rfid_dev_number );
+	class_destroy( rfid_class );
+	/* Abmelden des Treibers */
+	cdev_del( driver_object );
+	unregister_chrdev_region( rfid_dev_number, 1 );
+	return;
+}
+
+module_init( mod_init );
+module_exit( mod_exit );
+
+/* Metainformation */
+MODULE_LICENSE("GPL");
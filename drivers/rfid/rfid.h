@@ -0,0 +1,20 @@
+#ifndef RFID_H
+#define RFID_H
+
+#include <linux/types.h>
+
+#define RFID_UID_MAX 10
+
+#define RFID_EVENT_OVERFLOW 0x1	/* Vor diesem Ereignis gingen Ereignisse verloren */
+
+/* Das liefert read(): ein Eintrag pro Karte, die neu ins Feld gekommen ist */
+struct rfid_event {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC der Antwort auf REQA */
+	__u8 uid_size;		/* 4, 7 oder 10 */
+	__u8 sak;
+	__u8 uid[RFID_UID_MAX];
+	__u8 flags;
+	__u8 reserved[3];
+};
+
+#endif
@@ -7,6 +7,7 @@ if [ $# -eq 1 ]
     echo "Removing existing module"
     ssh root@$1 'rmmod ultrasonic'
     echo "Copying module"
+    scp configure_ultrasonic.dtb root@$1:/boot/overlays/
     scp ultrasonic.ko root@$1:
     echo "Installing module"
     ssh root@$1 'insmod /root/ultrasonic.ko'
@@ -1,284 +1,723 @@
+#include <linux/platform_device.h>
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <asm/io.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
-#include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/of.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
 #include <linux/interrupt.h>
 #include <linux/time.h>
-#include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/ktime.h>
-#include <linux/delay.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include "rc_core.h"
+#define CREATE_TRACE_POINTS
+#include "ultrasonic_trace.h"
 
 static dev_t gpio_dev_number;
 static struct cdev *driver_object;
 static struct class *gpio_class;
-static struct device *ultrasonic_left_dev, *ultrasonic_right_dev;
-static struct timeval left_previous_time, right_previous_time;
-static int left_irq_rising_pin, left_irq_falling_pin, right_irq_rising_pin, right_irq_falling_pin;
-static int left_distance, right_distance;
 
-// ToDo: GPIO entsprechend der Verschaltung anpassen.
-#define LEFT_ECHO_RISING_PIN    26
-#define LEFT_ECHO_FALLING_PIN    3
-#define LEFT_TRIGGER_PIN 19
+/*
+ * Die Sensoren stehen im Device Tree (configure_ultrasonic.dts), jeder Knoten
+ * wird ein eigenes Geraet /dev/ultrasonic-<side>. index ist Minor-Nummer und
+ * Platz in der Zustandsseite, so viele Sensoren kann der Treiber bedienen.
+ */
+#define ULTRASONIC_MAX_SENSORS 8
+
+// Platzhalter fuer eine Messung ohne Echo
+#define ECHO_TIMEOUT_US 200000
+
+// Zeit vom Trigger bis zur steigenden Flanke des Echos (Burst senden)
+#define ECHO_START_DELAY_US 500
+// Mindestabstand zwischen dem Ende eines Zeitfensters und dem naechsten Trigger
+#define SLOT_GUARD_US 1000
+
+/*
+ * Obergrenze fuer die Zeitfenster pro Sekunde. Die Gruppen wechseln sich ab,
+ * in jedem Fenster messen alle Sensoren einer Gruppe gleichzeitig. Ohne
+ * Grenze kommt die naechste Gruppe dran, sobald alle Echos da sind.
+ */
+static unsigned int measurement_rate = 0;
+module_param(measurement_rate, uint, 0644);
+MODULE_PARM_DESC(measurement_rate, "Maximale Zeitfenster pro Sekunde ueber alle Gruppen, 0 = unbegrenzt (Default 0)");
+
+/* Nach der Laufzeit fuer diese Entfernung gilt das Echo als verloren. */
+static unsigned int max_range_mm = 3000;
+module_param(max_range_mm, uint, 0644);
+MODULE_PARM_DESC(max_range_mm, "Maximale Messentfernung in mm (Default 3000)");
+
+/* Kuerzere Entfernungen kann der HC-SR04 nicht messen, das Hindernis ist direkt vor dem Sensor. */
+static unsigned int min_range_mm = 20;
+module_param(min_range_mm, uint, 0644);
+MODULE_PARM_DESC(min_range_mm, "Minimale gueltige Entfernung in mm (Default 20)");
+
+/* Schallgeschwindigkeit in mm/s, haengt von der Temperatur ab (343000 bei 20 Grad). */
+static unsigned int speed_of_sound = 343000;
+module_param(speed_of_sound, uint, 0644);
+MODULE_PARM_DESC(speed_of_sound, "Schallgeschwindigkeit in mm/s (Default 343000)");
+
+// Groesstes Fenster des Medianfilters
+#define FILTER_WINDOW_MAX 15
+
+/* Messungen im Medianfilter, 1 = ungefiltert. Ausreisser kuerzer als das halbe Fenster verschwinden. */
+static unsigned int filter_window = 5;
+module_param(filter_window, uint, 0644);
+MODULE_PARM_DESC(filter_window, "Fenster des Medianfilters in Messungen, 1-15 (Default 5)");
+
+// Anzahl Messungen, die pro Sensor zwischengespeichert werden (Zweierpotenz)
+#define SAMPLE_FIFO_SIZE 32
+
+#define SAMPLE_VALID        0x1  /* Echo im Messbereich, echo_us und distance_mm sind gueltig */
+#define SAMPLE_TIMEOUT      0x2  /* Kein Echo, echo_us = ECHO_TIMEOUT_US */
+#define SAMPLE_OVERFLOW     0x4  /* Vor dieser Messung gingen Messungen verloren */
+#define SAMPLE_OUT_OF_RANGE 0x8  /* Echo ausserhalb von min_range_mm bis max_range_mm */
+#define SAMPLE_FILTERED     0x10 /* filtered_mm ist gueltig */
+#define SAMPLE_TOO_CLOSE    0x20 /* Mit SAMPLE_OUT_OF_RANGE: Echo kuerzer als min_range_mm */
+
+/* Ein Eintrag im Ringpuffer, read() liefert beliebig viele davon am Stueck. */
+struct ultrasonic_record {
+	u64 timestamp_ns;     /* CLOCK_MONOTONIC der fallenden Flanke im harten Interrupt */
+	u32 sequence;         /* fortlaufende Nummer der Messung */
+	u32 echo_us;
+	u32 flags;
+	u32 handler_delay_ns; /* vom harten Interrupt bis zum Ablegen, 0 bei Timeout */
+	u32 distance_mm;      /* Entfernung dieser Messung, 0 ohne Echo */
+	u32 filtered_mm;      /* Median der letzten Messungen, nur mit SAMPLE_FILTERED */
+};
 
-#define RIGHT_ECHO_RISING_PIN    27
-#define RIGHT_ECHO_FALLING_PIN    2
-#define RIGHT_TRIGGER_PIN 17
+struct ultrasonic_sensor {
+	char name[32];
+	unsigned int index;	/* Minor-Nummer und Platz in der Zustandsseite */
+	unsigned int group;	/* Sensoren einer Gruppe stoeren sich nicht und messen gleichzeitig */
+	struct gpio_desc *trigger, *echo_rising, *echo_falling;
+	struct gpio_desc *echo;	/* nur eine Leitung fuer beide Flanken, sonst NULL */
+	int irq_rising_pin, irq_falling_pin;
+	bool echo_high;		/* steigende Flanke auf echo gesehen, nur im harten Interrupt */
+	struct device *dev;
+	int users;		/* geoeffnete Dateien, unter scheduler_lock */
+	bool active;
+	u64 rising_ns;
+	struct rc_irq_stamp falling_irq;
+	bool echo_pending;
+	bool overflow;
+	u32 sequence;
+	u32 history[FILTER_WINDOW_MAX];	/* letzte Entfernungen fuer den Filter, 0 = ungueltig */
+	unsigned int history_head;
+	spinlock_t lock;	/* Schreibseite des Ringpuffers und Filter */
+	struct mutex read_lock;	/* Leseseite des Ringpuffers */
+	DECLARE_RC_RING(samples, struct ultrasonic_record, SAMPLE_FIFO_SIZE);
+	wait_queue_head_t wait;
+};
 
-static struct timer_list left_timer, right_timer;
+/* Zustandsseite fuer mmap(): die neueste Messung jedes Sensors, nach index */
+struct ultrasonic_snapshot {
+	struct ultrasonic_record latest[ULTRASONIC_MAX_SENSORS];
+};
 
-int timeval_subtract(struct timeval *result, struct timeval *x, struct timeval *y)
+static struct rc_snapshot snapshot;
+
+/*
+ * Vom Device Tree angelegte Sensoren nach index. Geschrieben nur in probe und
+ * remove unter sensors_lock; der Timer liest nur Sensoren, die gerade geoeffnet
+ * sind und deshalb nicht entfernt werden koennen.
+ */
+static struct ultrasonic_sensor *sensors[ULTRASONIC_MAX_SENSORS];
+static DEFINE_MUTEX(sensors_lock);
+
+/*
+ * Medianfilter ueber die letzten filter_window Entfernungen, ungueltige
+ * Messungen (0) zaehlen als Luecke. Ein Ergebnis gibt es nur, wenn mehr als
+ * die Haelfte des Fensters gueltig ist. Ein Sprung der Entfernung kommt erst
+ * nach (filter_window - 1) / 2 Messungen am Ausgang an. Aufruf mit sensor->lock.
+ */
+static bool filter_distance(struct ultrasonic_sensor *sensor, u32 distance_mm, u32 *filtered)
 {
-  /* Perform the carry for the later subtraction by updating y. */
-  if (x->tv_usec < y->tv_usec) {
-    int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
-    y->tv_usec -= 1000000 * nsec;
-    y->tv_sec += nsec;
-  }
-  if (x->tv_usec - y->tv_usec > 1000000) {
-    int nsec = (x->tv_usec - y->tv_usec) / 1000000;
-    y->tv_usec += 1000000 * nsec;
-    y->tv_sec -= nsec;
-  }
-
-  /* Compute the time remaining to wait.
-     tv_usec is certainly positive. */
-  result->tv_sec = x->tv_sec - y->tv_sec;
-  result->tv_usec = x->tv_usec - y->tv_usec;
-
-  /* Return 1 if result is negative. */
-  return x->tv_sec < y->tv_sec;
+	unsigned int window = clamp(READ_ONCE(filter_window), 1U, (unsigned int)FILTER_WINDOW_MAX);
+	u32 sorted[FILTER_WINDOW_MAX];
+	unsigned int i, j, n = 0;
+	u32 value;
+
+	sensor->history_head = (sensor->history_head + 1) % FILTER_WINDOW_MAX;
+	sensor->history[sensor->history_head] = distance_mm;
+
+	// Sortiert einfuegen, das Fenster ist klein
+	for (i = 0; i < window; i++) {
+		value = sensor->history[(sensor->history_head + FILTER_WINDOW_MAX - i) % FILTER_WINDOW_MAX];
+		if (!value)
+			continue;
+		for (j = n; j > 0 && sorted[j - 1] > value; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = value;
+		n++;
+	}
+	if (n * 2 <= window)
+		return false;
+	*filtered = sorted[n / 2];
+	return true;
 }
 
-static void trigger( unsigned long pin )
+/*
+ * Neue Messung in den Ringpuffer legen und blockierte Leser aufwecken.
+ * echo_ns ist die Laenge des Echos, 0 bei Timeout. Aufruf mit sensor->lock.
+ * Ist der Puffer voll, wird die Messung verworfen und die naechste
+ * abgelegte Messung mit SAMPLE_OVERFLOW markiert.
+ */
+static void publish_sample(struct ultrasonic_sensor *sensor, u64 timestamp,
+	u64 echo_ns, u32 flags, u32 handler_delay_ns)
 {
-	gpio_set_value(pin, 1);
-	usleep_range(10, 10);
-	gpio_set_value(pin, 0);
-	// Fallbacks
-	if(pin == LEFT_TRIGGER_PIN) {
-		mod_timer(&left_timer, jiffies + msecs_to_jiffies(200));
-	} else if (pin == RIGHT_TRIGGER_PIN) {
-		mod_timer(&right_timer, jiffies + msecs_to_jiffies(200));
+	struct ultrasonic_record record = {
+		.timestamp_ns = timestamp,
+		.sequence = ++sensor->sequence,
+		.echo_us = ECHO_TIMEOUT_US,
+		.flags = flags,
+		.handler_delay_ns = handler_delay_ns,
+	};
+	struct ultrasonic_snapshot *latest;
+	unsigned long snapshot_flags;
+	u32 min_mm = max(READ_ONCE(min_range_mm), 1U);
+	u32 filter_mm = 0;
+
+	if (flags & SAMPLE_VALID) {
+		// Hin- und Rueckweg, in mm ohne Gleitkomma
+		record.echo_us = div_u64(echo_ns, NSEC_PER_USEC);
+		record.distance_mm = div_u64(echo_ns * READ_ONCE(speed_of_sound), 2 * NSEC_PER_SEC);
+		filter_mm = record.distance_mm;
+		if (record.distance_mm < min_mm) {
+			// Zu nah zum Messen, fuer den Filter so nah wie messbar
+			record.flags = (flags & ~SAMPLE_VALID) | SAMPLE_OUT_OF_RANGE | SAMPLE_TOO_CLOSE;
+			filter_mm = min_mm;
+		} else if (record.distance_mm > READ_ONCE(max_range_mm)) {
+			record.flags = (flags & ~SAMPLE_VALID) | SAMPLE_OUT_OF_RANGE;
+			filter_mm = 0;
+		}
 	}
+	if (filter_distance(sensor, filter_mm, &record.filtered_mm))
+		record.flags |= SAMPLE_FILTERED;
+
+	sensor->echo_pending = false;
+	if (sensor->overflow)
+		record.flags |= SAMPLE_OVERFLOW;
+	sensor->overflow = !rc_ring_put(&sensor->samples, &record);
+
+	latest = rc_snapshot_begin(&snapshot, &snapshot_flags);
+	latest->latest[sensor->index] = record;
+	rc_snapshot_end(&snapshot, snapshot_flags);
+
+	wake_up_interruptible(&sensor->wait);
 }
 
-static irqreturn_t rising_handler(int irq, void *dev){
+static bool sample_available(struct ultrasonic_sensor *sensor)
+{
+	return !rc_ring_empty(&sensor->samples);
+}
 
-  if(irq == left_irq_rising_pin){
-    do_gettimeofday(&left_previous_time);
-  } else if(irq == right_irq_rising_pin) {
-    do_gettimeofday(&right_previous_time);
-  }
+/*
+ * Ablaufsteuerung der Messungen: Ein hrtimer triggert die Gruppen reihum,
+ * damit sich die Echos nicht gegenseitig stoeren. Jede Gruppe bekommt ein
+ * Zeitfenster (slot), darin werden alle ihre geoeffneten Sensoren gleichzeitig
+ * getriggert. Das Fenster endet, sobald jeder Sensor der Gruppe sein Echo
+ * hat (echo_done()), spaetestens nach der Laufzeit fuer max_range_mm; dann
+ * wird die Messung als SAMPLE_TIMEOUT abgelegt. Nach SLOT_GUARD_US ist die
+ * naechste Gruppe dran. Weitere Sensoren in bestehenden Gruppen senken die
+ * Messrate also nicht.
+ */
+static struct hrtimer scheduler;
+static DEFINE_MUTEX(scheduler_lock);
+static int active_sensors;
+static DEFINE_SPINLOCK(slot_lock);	/* schuetzt die folgenden Felder */
+static bool scheduler_running;
+static unsigned int current_group;
+static ktime_t slot_start;
+static bool waiting_for_echo;
+
+static u64 echo_timeout_ns(void)
+{
+	u64 flight_us = div_u64((u64)READ_ONCE(max_range_mm) * 2 * USEC_PER_SEC,
+		max(READ_ONCE(speed_of_sound), 1U));
 
-	return IRQ_HANDLED;
+	return (flight_us + ECHO_START_DELAY_US) * NSEC_PER_USEC;
 }
 
-static irqreturn_t falling_handler(int irq, void *dev){
-	struct timeval current_time, result;
-	do_gettimeofday(&current_time);
-
-  if(irq == left_irq_falling_pin){
-    timeval_subtract(&result, &current_time, &left_previous_time);
-  	left_distance = result.tv_usec;
-    mod_timer(&left_timer, jiffies + msecs_to_jiffies(25));
-  } else if(irq == right_irq_falling_pin) {
-    timeval_subtract(&result, &current_time, &right_previous_time);
-  	right_distance = result.tv_usec;
-    mod_timer(&right_timer, jiffies + msecs_to_jiffies(25));
-  }
+/* Naechster Trigger nach einem Fenster, das now endet. Aufruf mit slot_lock. */
+static ktime_t next_slot_start(ktime_t now)
+{
+	unsigned int rate = READ_ONCE(measurement_rate);
+	ktime_t next = ktime_add_ns(now, SLOT_GUARD_US * NSEC_PER_USEC);
 
-	return IRQ_HANDLED;
+	if (rate)
+		next = max(next, ktime_add_ns(slot_start, NSEC_PER_SEC / rate));
+	return next;
 }
 
-static int driver_open( struct inode *geraetedatei, struct file *instanz )
+/* Geoeffneter Sensor der Gruppe group mit index i, sonst NULL */
+static struct ultrasonic_sensor *active_in_group(int i, unsigned int group)
 {
-	int err = -1;
-  struct device* ultrasonic_dev;
-  int trigger_pin, echo_falling_pin, echo_rising_pin, *irq_rising_pin, *irq_falling_pin;
-  struct timer_list *timer;
-
-  if (iminor(geraetedatei)==0) {
-    trigger_pin = LEFT_TRIGGER_PIN;
-    echo_falling_pin = LEFT_ECHO_FALLING_PIN;
-    echo_rising_pin = LEFT_ECHO_RISING_PIN;
-    ultrasonic_dev = ultrasonic_left_dev;
-    irq_rising_pin = &left_irq_rising_pin;
-    irq_falling_pin = &left_irq_falling_pin;
-    timer = &left_timer;
-    left_distance = 200000;
-  } else {
-    trigger_pin = RIGHT_TRIGGER_PIN;
-    echo_falling_pin = RIGHT_ECHO_FALLING_PIN;
-    echo_rising_pin = RIGHT_ECHO_RISING_PIN;
-    ultrasonic_dev = ultrasonic_right_dev;
-    irq_rising_pin = &right_irq_rising_pin;
-    irq_falling_pin = &right_irq_falling_pin;
-    timer = &right_timer;
-    right_distance = 200000;
-  }
-
-	// TRIGGER_PIN reservieren
-	err = gpio_request( trigger_pin, "rpi-gpio-trigger" );
-	if (err) {
-		printk("gpio_request failed\n");
-		return -EIO;
-	}
-	// TRIGGER_PIN auf Ausgabe konfigurieren
-	err = gpio_direction_output( trigger_pin, 0 );
-	if (err) {
-		printk("gpio_direction_output failed\n");
-		gpio_free( trigger_pin );
-		return -EIO;
+	struct ultrasonic_sensor *sensor = READ_ONCE(sensors[i]);
+
+	if (sensor && READ_ONCE(sensor->active) && sensor->group == group)
+		return sensor;
+	return NULL;
+}
+
+/* Alle Sensoren der Gruppe gemeinsam, der Triggerpuls ist fuer alle derselbe */
+static void trigger_group(unsigned int group)
+{
+	struct ultrasonic_sensor *sensor;
+	unsigned long flags;
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < ULTRASONIC_MAX_SENSORS; i++) {
+		if (!(sensor = active_in_group(i, group)))
+			continue;
+		spin_lock_irqsave(&sensor->lock, flags);
+		sensor->echo_pending = true;
+		spin_unlock_irqrestore(&sensor->lock, flags);
+		gpiod_set_value(sensor->trigger, 1);
+		count++;
 	}
-	err = gpio_request( echo_rising_pin, "rpi-gpio-echo-rising" );
-	if (err) {
-		printk("gpio_request failed\n");
-		gpio_free( trigger_pin );
-		return -EIO;
+	trace_ultrasonic_trigger(group, count);
+	udelay(10);
+	for (i = 0; i < ULTRASONIC_MAX_SENSORS; i++) {
+		if ((sensor = active_in_group(i, group)))
+			gpiod_set_value(sensor->trigger, 0);
 	}
-	err = gpio_direction_input( echo_rising_pin );
-	if (err) {
-		printk("gpio_direction_input failed\n");
-		gpio_free( trigger_pin );
-		gpio_free( echo_rising_pin );
-		return -EIO;
+}
+
+static void echo_timeout(struct ultrasonic_sensor *sensor)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sensor->lock, flags);
+	if (sensor->echo_pending) {
+		trace_ultrasonic_timeout(sensor->index);
+		publish_sample(sensor, rc_now_ns(), 0, SAMPLE_TIMEOUT, 0);
 	}
-	err = gpio_request( echo_falling_pin, "rpi-gpio-echo-falling" );
-	if (err) {
-		printk("gpio_request failed\n");
-		gpio_free( trigger_pin );
-		gpio_free( echo_rising_pin );
-		return -EIO;
+	spin_unlock_irqrestore(&sensor->lock, flags);
+}
+
+/* Kleinste Gruppe mit geoeffnetem Sensor nach group, sonst wieder von vorn */
+static unsigned int next_group(unsigned int group)
+{
+	struct ultrasonic_sensor *sensor;
+	unsigned int next = UINT_MAX, first = UINT_MAX;
+	int i;
+
+	for (i = 0; i < ULTRASONIC_MAX_SENSORS; i++) {
+		sensor = READ_ONCE(sensors[i]);
+		if (!sensor || !READ_ONCE(sensor->active))
+			continue;
+		first = min(first, sensor->group);
+		if (sensor->group > group)
+			next = min(next, sensor->group);
 	}
-	err = gpio_direction_input( echo_falling_pin );
-	if (err) {
-		printk("gpio_direction_input failed\n");
-		gpio_free( trigger_pin );
-		gpio_free( echo_falling_pin );
-		gpio_free( echo_rising_pin );
-		return -EIO;
+	if (next != UINT_MAX)
+		return next;
+	return first != UINT_MAX ? first : group;
+}
+
+static enum hrtimer_restart schedule_measurement(struct hrtimer *timer)
+{
+	struct ultrasonic_sensor *sensor;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&slot_lock, flags);
+	if (!waiting_for_echo) {
+		slot_start = hrtimer_get_expires(timer);
+		trigger_group(current_group);
+		waiting_for_echo = true;
+		hrtimer_set_expires(timer, ktime_add_ns(slot_start, echo_timeout_ns()));
+		spin_unlock_irqrestore(&slot_lock, flags);
+		return HRTIMER_RESTART;
 	}
 
-	if ( (*irq_rising_pin = gpio_to_irq(echo_rising_pin)) < 0 ) {
-		printk("GPIO to IRQ mapping failure %d\n", echo_rising_pin);
-		gpio_free( trigger_pin );
-		gpio_free( echo_falling_pin );
-		gpio_free( echo_rising_pin );
-		return -EIO;
+	for (i = 0; i < ULTRASONIC_MAX_SENSORS; i++) {
+		if ((sensor = active_in_group(i, current_group)))
+			echo_timeout(sensor);
 	}
+	waiting_for_echo = false;
 
-	if ( (*irq_falling_pin = gpio_to_irq(echo_falling_pin)) < 0 ) {
-		printk("GPIO to IRQ mapping failure %d\n", echo_falling_pin);
-		gpio_free( trigger_pin );
-		gpio_free( echo_falling_pin );
-		gpio_free( echo_rising_pin );
-		return -EIO;
+	current_group = next_group(current_group);
+	hrtimer_set_expires(timer, next_slot_start(hrtimer_get_expires(timer)));
+	spin_unlock_irqrestore(&slot_lock, flags);
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Nach jedem Echo: Hat jeder Sensor der laufenden Gruppe sein Echo, endet
+ * das Fenster sofort statt erst mit dem Timeout. Laeuft der Timer gerade,
+ * bleibt es bei seinem Ablauf, der Timeout findet dann nichts mehr offen.
+ */
+static void echo_done(unsigned int group)
+{
+	struct ultrasonic_sensor *sensor;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&slot_lock, flags);
+	if (!scheduler_running || !waiting_for_echo || group != current_group)
+		goto unlock;
+	for (i = 0; i < ULTRASONIC_MAX_SENSORS; i++) {
+		sensor = active_in_group(i, group);
+		if (sensor && READ_ONCE(sensor->echo_pending))
+			goto unlock;
 	}
+	if (hrtimer_try_to_cancel(&scheduler) < 0)
+		goto unlock;
+
+	waiting_for_echo = false;
+	current_group = next_group(current_group);
+	hrtimer_start(&scheduler, next_slot_start(ktime_get()), HRTIMER_MODE_ABS);
+unlock:
+	spin_unlock_irqrestore(&slot_lock, flags);
+}
 
-	setup_timer(timer, trigger, trigger_pin);
+/* Der erste Nutzer eines Sensors beginnt mit leerem Puffer und Filter */
+static void scheduler_add(struct ultrasonic_sensor *sensor)
+{
+	mutex_lock(&scheduler_lock);
+	if (sensor->users++ == 0) {
+		rc_ring_reset(&sensor->samples);
+		memset(sensor->history, 0, sizeof(sensor->history));
+		sensor->echo_pending = false;
+		sensor->overflow = false;
+		WRITE_ONCE(sensor->active, true);
+		if (active_sensors++ == 0) {
+			spin_lock_irq(&slot_lock);
+			current_group = sensor->group;
+			waiting_for_echo = false;
+			scheduler_running = true;
+			hrtimer_start(&scheduler, ktime_get(), HRTIMER_MODE_ABS);
+			spin_unlock_irq(&slot_lock);
+		}
+	}
+	mutex_unlock(&scheduler_lock);
+}
 
-	if (request_irq(*irq_rising_pin, rising_handler, IRQF_TRIGGER_RISING, "ultrasonic_rising", ultrasonic_dev)) {
-		printk(KERN_INFO "short: can't get assigned irq %i\n", *irq_rising_pin);
-		gpio_free( trigger_pin );
-		gpio_free( echo_falling_pin );
-		gpio_free( echo_rising_pin );
-		return -EIO;
+static void scheduler_remove(struct ultrasonic_sensor *sensor)
+{
+	mutex_lock(&scheduler_lock);
+	if (--sensor->users == 0) {
+		WRITE_ONCE(sensor->active, false);
+		if (--active_sensors == 0) {
+			// Danach startet auch echo_done() den Timer nicht mehr
+			spin_lock_irq(&slot_lock);
+			scheduler_running = false;
+			spin_unlock_irq(&slot_lock);
+			hrtimer_cancel(&scheduler);
+		}
 	}
+	mutex_unlock(&scheduler_lock);
+}
+
+/*
+ * Merkt sich nur die Zeit und nimmt kein Lock, darf deshalb auch unter
+ * PREEMPT_RT im harten Interrupt laufen (IRQF_NO_THREAD).
+ */
+static irqreturn_t rising_handler(int irq, void *dev){
+	struct ultrasonic_sensor *sensor = dev;
+	u64 now = rc_now_ns();
+
+	WRITE_ONCE(sensor->rising_ns, now);
+	trace_ultrasonic_irq(sensor->index, true, now);
+	return IRQ_HANDLED;
+}
 
-	if (request_irq(*irq_falling_pin, falling_handler, IRQF_TRIGGER_FALLING, "ultrasonic_falling", ultrasonic_dev)) {
-		printk(KERN_INFO "short: can't get assigned irq %i\n", *irq_falling_pin);
-		free_irq(*irq_rising_pin, ultrasonic_dev);
-		gpio_free( trigger_pin );
-		gpio_free( echo_falling_pin );
-		gpio_free( echo_rising_pin );
-		return -EIO;
+/*
+ * Beide Flanken auf einer Leitung (echo-gpios), laeuft wie rising_handler im
+ * harten Interrupt und stempelt die Zeit vor allem anderen. Welche Flanke es
+ * war, sagt der Pegel. Eine fallende Flanke zaehlt nur nach einer steigenden,
+ * erst dann wird falling_handler geweckt; Stoerungen ohne steigende Flanke
+ * fallen so heraus.
+ */
+static irqreturn_t echo_handler(int irq, void *dev){
+	struct ultrasonic_sensor *sensor = container_of(dev, struct ultrasonic_sensor, falling_irq);
+	u64 now = rc_now_ns();
+	bool rising = gpiod_get_value(sensor->echo);
+
+	trace_ultrasonic_irq(sensor->index, rising, now);
+	if (rising) {
+		WRITE_ONCE(sensor->rising_ns, now);
+		sensor->echo_high = true;
+		return IRQ_HANDLED;
 	}
+	if (!sensor->echo_high)
+		return IRQ_HANDLED;
+	sensor->echo_high = false;
+	sensor->falling_irq.hardirq_ns = now;
+	return IRQ_WAKE_THREAD;
+}
+
+/* Thread-Handler, die Zeit der Flanke stammt aus dem harten Interrupt */
+static irqreturn_t falling_handler(int irq, void *dev){
+	struct ultrasonic_sensor *sensor = container_of(dev, struct ultrasonic_sensor, falling_irq);
+	u64 falling_ns = sensor->falling_irq.hardirq_ns;
+	u64 echo_ns = falling_ns - READ_ONCE(sensor->rising_ns);
+	u32 delay_ns;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sensor->lock, flags);
+	delay_ns = rc_irq_delay_ns(&sensor->falling_irq);
+	trace_ultrasonic_echo(sensor->index, echo_ns, delay_ns, sensor->echo_pending);
+	if (sensor->echo_pending)
+		publish_sample(sensor, falling_ns, echo_ns, SAMPLE_VALID, delay_ns);
+	spin_unlock_irqrestore(&sensor->lock, flags);
+
+	echo_done(sensor->group);
+	return IRQ_HANDLED;
+}
+
+static int driver_open( struct inode *geraetedatei, struct file *instanz )
+{
+	struct ultrasonic_sensor *sensor;
 
-	printk("gpio %d and  (%d,%d) successfully configured\n",trigger_pin, echo_rising_pin, echo_falling_pin);
-	trigger(trigger_pin);
+	mutex_lock(&sensors_lock);
+	sensor = sensors[iminor(geraetedatei)];
+	if (sensor)
+		scheduler_add(sensor);
+	mutex_unlock(&sensors_lock);
+	if (!sensor)
+		return -ENODEV;
+
+	instanz->private_data = sensor;
 	return 0;
 }
 
 static int driver_close( struct inode *geraete_datei, struct file *instanz )
 {
-	printk( "driver_close called\n");
+	struct ultrasonic_sensor *sensor = instanz->private_data;
 
-  struct device* ultrasonic_dev;
-  int trigger_pin, echo_falling_pin, echo_rising_pin, *irq_rising_pin, *irq_falling_pin;
-  struct timer_list *timer;
-
-  if (iminor(geraete_datei)==0) {
-    trigger_pin = LEFT_TRIGGER_PIN;
-    echo_falling_pin = LEFT_ECHO_FALLING_PIN;
-    echo_rising_pin = LEFT_ECHO_RISING_PIN;
-    ultrasonic_dev = ultrasonic_left_dev;
-    irq_rising_pin = &left_irq_rising_pin;
-    irq_falling_pin = &left_irq_falling_pin;
-    timer = &left_timer;
-  } else {
-    trigger_pin = RIGHT_TRIGGER_PIN;
-    echo_falling_pin = RIGHT_ECHO_FALLING_PIN;
-    echo_rising_pin = RIGHT_ECHO_RISING_PIN;
-    ultrasonic_dev = ultrasonic_right_dev;
-    irq_rising_pin = &right_irq_rising_pin;
-    irq_falling_pin = &right_irq_falling_pin;
-    timer = &right_timer;
-  }
-
-	// TRIGGER_PIN und ECHO_PIN freigeben
-	del_timer(timer);
-	free_irq(*irq_rising_pin, ultrasonic_dev);
-	free_irq(*irq_falling_pin, ultrasonic_dev);
-	gpio_free( echo_falling_pin );
-	gpio_free( echo_rising_pin );
-	gpio_free( trigger_pin );
+	printk( "driver_close called\n");
+	scheduler_remove(sensor);
 	return 0;
 }
 
+/*
+ * Leert den Ringpuffer in ganzen struct ultrasonic_record, soweit der Puffer
+ * des Aufrufers reicht. Ohne O_NONBLOCK blockiert read(), bis mindestens eine
+ * Messung (fallende Flanke oder Timeout des Echos) vorliegt.
+ */
 static ssize_t driver_read( struct file *instanz, char __user *user,
 	size_t count, loff_t *offset )
 {
-	int to_copy, not_copied;
-  int *distance;
+	struct ultrasonic_sensor *sensor = instanz->private_data;
+	ssize_t copied;
 
-  if(iminor(instanz->f_inode)==0){
-    distance = &left_distance;
-  } else {
-    distance = &right_distance;
-  }
+	if (count < sizeof(struct ultrasonic_record))
+		return -EINVAL;
 
-	//printk( "driver_read %d\n", *distance);
+	if (instanz->f_flags & O_NONBLOCK) {
+		if (!sample_available(sensor))
+			return -EAGAIN;
+	} else if (wait_event_interruptible(sensor->wait, sample_available(sensor))) {
+		return -ERESTARTSYS;
+	}
+
+	if (mutex_lock_interruptible(&sensor->read_lock))
+		return -ERESTARTSYS;
+	copied = rc_ring_to_user(&sensor->samples, user, count);
+	mutex_unlock(&sensor->read_lock);
+
+	return copied;
+}
 
-	to_copy = min( count, sizeof(*distance) );
-	not_copied=copy_to_user( user, distance, to_copy );
+static unsigned int driver_poll( struct file *instanz, poll_table *wait )
+{
+	struct ultrasonic_sensor *sensor = instanz->private_data;
 
-	return to_copy-not_copied;
+	poll_wait(instanz, &sensor->wait, wait);
+	if (sample_available(sensor))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/* Beide Geraete blenden dieselbe Zustandsseite ein. */
+static int driver_mmap( struct file *instanz, struct vm_area_struct *vma )
+{
+	return rc_snapshot_mmap(&snapshot, vma);
 }
 
 static struct file_operations fops = {
 	.owner= THIS_MODULE,
 	.read = driver_read,
+	.poll = driver_poll,
+	.mmap = driver_mmap,
 	.open= driver_open,
 	.release= driver_close,
 };
 
+/* Eine Leitung, ein Interrupt fuer beide Flanken */
+static int request_echo(struct device *dev, struct ultrasonic_sensor *sensor)
+{
+	if ( (sensor->irq_falling_pin = gpiod_to_irq(sensor->echo)) < 0 ) {
+		dev_err(dev, "GPIO to IRQ mapping failure (echo)\n");
+		return sensor->irq_falling_pin;
+	}
+	sensor->irq_rising_pin = sensor->irq_falling_pin;
+	return devm_request_threaded_irq(dev, sensor->irq_falling_pin, echo_handler,
+		falling_handler, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+		sensor->name, &sensor->falling_irq);
+}
+
+/* Das Echo liegt an zwei Leitungen, je eine pro Flanke */
+static int request_echo_pair(struct device *dev, struct ultrasonic_sensor *sensor)
+{
+	int err;
+
+	sensor->echo_rising = devm_gpiod_get(dev, "echo-rising", GPIOD_IN);
+	if (IS_ERR(sensor->echo_rising)) {
+		dev_err(dev, "Requesting echo-rising GPIO failed\n");
+		return PTR_ERR(sensor->echo_rising);
+	}
+	sensor->echo_falling = devm_gpiod_get(dev, "echo-falling", GPIOD_IN);
+	if (IS_ERR(sensor->echo_falling)) {
+		dev_err(dev, "Requesting echo-falling GPIO failed\n");
+		return PTR_ERR(sensor->echo_falling);
+	}
+
+	if ( (sensor->irq_rising_pin = gpiod_to_irq(sensor->echo_rising)) < 0 ) {
+		dev_err(dev, "GPIO to IRQ mapping failure (echo-rising)\n");
+		return sensor->irq_rising_pin;
+	}
+	if ( (sensor->irq_falling_pin = gpiod_to_irq(sensor->echo_falling)) < 0 ) {
+		dev_err(dev, "GPIO to IRQ mapping failure (echo-falling)\n");
+		return sensor->irq_falling_pin;
+	}
+	err = devm_request_irq(dev, sensor->irq_rising_pin, rising_handler,
+		IRQF_TRIGGER_RISING | IRQF_NO_THREAD, sensor->name, sensor);
+	if (err)
+		return err;
+	return rc_devm_request_irq(dev, sensor->irq_falling_pin, falling_handler,
+		IRQF_TRIGGER_FALLING, sensor->name, &sensor->falling_irq);
+}
+
+/*
+ * Ein Knoten mit compatible = "ultrasonic". Pflicht sind side (Name des
+ * Geraets), index, das GPIO trigger und fuer das Echo entweder echo (beide
+ * Flanken auf einer Leitung) oder das Paar echo-rising und echo-falling.
+ * group ist optional, ohne misst der Sensor in der Gruppe mit seinem index.
+ * Pins und Interrupts gehoeren dem Sensor ab hier, open() nimmt ihn nur in
+ * die Ablaufsteuerung auf.
+ */
+static int my_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct device_node *np = dev->of_node;
+	struct ultrasonic_sensor *sensor;
+	const char *side;
+	u32 index, group;
+	int err;
+
+	if (of_property_read_string(np, "side", &side) ||
+			of_property_read_u32(np, "index", &index)) {
+		dev_err(dev, "side and index are required\n");
+		return -EINVAL;
+	}
+	if (index >= ULTRASONIC_MAX_SENSORS) {
+		dev_err(dev, "index %u out of range\n", index);
+		return -EINVAL;
+	}
+	if (of_property_read_u32(np, "group", &group))
+		group = index;
+
+	sensor = devm_kzalloc(dev, sizeof(*sensor), GFP_KERNEL);
+	if (!sensor)
+		return -ENOMEM;
+	snprintf(sensor->name, sizeof(sensor->name), "ultrasonic-%s", side);
+	sensor->index = index;
+	sensor->group = group;
+	spin_lock_init(&sensor->lock);
+	mutex_init(&sensor->read_lock);
+	INIT_RC_RING(sensor->samples);
+	init_waitqueue_head(&sensor->wait);
+
+	sensor->trigger = devm_gpiod_get(dev, "trigger", GPIOD_OUT_LOW);
+	if (IS_ERR(sensor->trigger)) {
+		dev_err(dev, "Requesting trigger GPIO failed\n");
+		return PTR_ERR(sensor->trigger);
+	}
+	sensor->echo = devm_gpiod_get_optional(dev, "echo", GPIOD_IN);
+	if (IS_ERR(sensor->echo)) {
+		dev_err(dev, "Requesting echo GPIO failed\n");
+		return PTR_ERR(sensor->echo);
+	}
+	err = sensor->echo ? request_echo(dev, sensor) : request_echo_pair(dev, sensor);
+	if (err)
+		return err;
+
+	mutex_lock(&sensors_lock);
+	if (sensors[index]) {
+		mutex_unlock(&sensors_lock);
+		dev_err(dev, "index %u is already used\n", index);
+		return -EBUSY;
+	}
+	sensor->dev = device_create( gpio_class, dev, gpio_dev_number + index,
+		sensor, "%s", sensor->name );
+	if (IS_ERR(sensor->dev)) {
+		mutex_unlock(&sensors_lock);
+		return PTR_ERR(sensor->dev);
+	}
+	WRITE_ONCE(sensors[index], sensor);
+	mutex_unlock(&sensors_lock);
+
+	platform_set_drvdata(pdev, sensor);
+	dev_info(sensor->dev, "index %u, group %u\n", index, group);
+	return 0;
+}
+
+static int my_remove(struct platform_device *pdev)
+{
+	struct ultrasonic_sensor *sensor = platform_get_drvdata(pdev);
+
+	mutex_lock(&sensors_lock);
+	WRITE_ONCE(sensors[sensor->index], NULL);
+	device_destroy( gpio_class, gpio_dev_number + sensor->index );
+	mutex_unlock(&sensors_lock);
+	return 0;
+}
+
+static struct of_device_id my_match_table[] = {
+     {
+             .compatible = "ultrasonic",
+     },
+	 {},
+};
+MODULE_DEVICE_TABLE(of, my_match_table);
+
+static struct platform_driver my_platform_driver = {
+	.probe = my_probe,
+	.remove = my_remove,
+	.driver = {
+		.name = "ultrasonic",
+		.owner = THIS_MODULE,
+		.of_match_table = of_match_ptr(my_match_table),
+		/* Geoeffnete Sensoren duerfen nicht per sysfs abgehaengt werden */
+		.suppress_bind_attrs = true,
+	},
+};
+
 static int __init mod_init( void )
 {
-	if( alloc_chrdev_region(&gpio_dev_number,0,2,"ultrasonic")<0 )
-		return -EIO;
+	if( rc_snapshot_init(&snapshot, sizeof(struct ultrasonic_snapshot)) )
+		return -ENOMEM;
+	if( alloc_chrdev_region(&gpio_dev_number,0,ULTRASONIC_MAX_SENSORS,"ultrasonic")<0 )
+		goto free_snapshot;
 	driver_object = cdev_alloc(); /* Anmeldeobjekt reservieren */
 	if( driver_object==NULL )
 		goto free_device_number;
 	driver_object->owner = THIS_MODULE;
 	driver_object->ops = &fops;
-	if( cdev_add(driver_object,gpio_dev_number,2) )
+	if( cdev_add(driver_object,gpio_dev_number,ULTRASONIC_MAX_SENSORS) )
 		goto free_cdev;
 	/* Eintrag im Sysfs, damit Udev den Geraetedateieintrag erzeugt. */
 	gpio_class = class_create( THIS_MODULE, "ultrasonic" );
@@ -286,30 +725,36 @@ static int __init mod_init( void )
 		pr_err( "gpio: no udev support\n");
 		goto free_cdev;
 	}
-	ultrasonic_left_dev = device_create( gpio_class, NULL, gpio_dev_number,
-		NULL, "%s", "ultrasonic-left" );
-  ultrasonic_right_dev = device_create( gpio_class, NULL, gpio_dev_number +1,
-      NULL, "%s", "ultrasonic-right" );
+	hrtimer_init(&scheduler, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	scheduler.function = schedule_measurement;
+
+	/* Legt fuer jeden Knoten im Device Tree ein Geraet an */
+	if( platform_driver_register(&my_platform_driver) )
+		goto free_class;
 
-	dev_info(ultrasonic_left_dev, "mod_init");
+	pr_info("ultrasonic: mod_init\n");
 	return 0;
+free_class:
+	class_destroy( gpio_class );
 free_cdev:
 	kobject_put( &driver_object->kobj );
 free_device_number:
-	unregister_chrdev_region( gpio_dev_number, 2 );
+	unregister_chrdev_region( gpio_dev_number, ULTRASONIC_MAX_SENSORS );
+free_snapshot:
+	rc_snapshot_free(&snapshot);
 	return -EIO;
 }
 
 static void __exit mod_exit( void )
 {
-	dev_info(ultrasonic_left_dev, "mod_exit");
-	/* Loeschen des Sysfs-Eintrags und damit der Geraetedatei */
-	device_destroy( gpio_class, gpio_dev_number );
-  device_destroy( gpio_class, gpio_dev_number + 1 );
+	pr_info("ultrasonic: mod_exit\n");
+	/* Loescht ueber my_remove() die Geraetedateien */
+	platform_driver_unregister(&my_platform_driver);
 	class_destroy( gpio_class );
 	/* Abmelden des Treibers */
 	cdev_del( driver_object );
-	unregister_chrdev_region(gpio_dev_number, 2);
+	unregister_chrdev_region(gpio_dev_number, ULTRASONIC_MAX_SENSORS);
+	rc_snapshot_free(&snapshot);
 	return;
 }
 
@@ -0,0 +1,98 @@
+/*
+ * Tracepoints des Ultraschall-Treibers (events/ultrasonic/ im
+ * Tracing-Verzeichnis). Abgeschaltet kosten sie nur einen nicht genommenen
+ * Sprung und duerfen deshalb auch im harten Interrupt stehen.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ultrasonic
+
+#if !defined(_ULTRASONIC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ULTRASONIC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Alle geoeffneten Sensoren einer Gruppe wurden gemeinsam getriggert */
+TRACE_EVENT(ultrasonic_trigger,
+	TP_PROTO(unsigned int group, unsigned int sensors),
+	TP_ARGS(group, sensors),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, group)
+		__field(unsigned int, sensors)
+	),
+
+	TP_fast_assign(
+		__entry->group = group;
+		__entry->sensors = sensors;
+	),
+
+	TP_printk("group=%u sensors=%u", __entry->group, __entry->sensors)
+);
+
+/* Flanke des Echos im harten Interrupt */
+TRACE_EVENT(ultrasonic_irq,
+	TP_PROTO(unsigned int index, bool rising, u64 timestamp_ns),
+	TP_ARGS(index, rising, timestamp_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(bool, rising)
+		__field(u64, timestamp_ns)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->rising = rising;
+		__entry->timestamp_ns = timestamp_ns;
+	),
+
+	TP_printk("index=%u edge=%s timestamp_ns=%llu", __entry->index,
+		__entry->rising ? "rising" : "falling", __entry->timestamp_ns)
+);
+
+/* Fallende Flanke im Thread-Handler, echo_ns ist die Laenge des Echos */
+TRACE_EVENT(ultrasonic_echo,
+	TP_PROTO(unsigned int index, u64 echo_ns, u32 handler_delay_ns, bool pending),
+	TP_ARGS(index, echo_ns, handler_delay_ns, pending),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(u64, echo_ns)
+		__field(u32, handler_delay_ns)
+		__field(bool, pending)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->echo_ns = echo_ns;
+		__entry->handler_delay_ns = handler_delay_ns;
+		__entry->pending = pending;
+	),
+
+	TP_printk("index=%u echo_ns=%llu delay_ns=%u pending=%d", __entry->index,
+		__entry->echo_ns, __entry->handler_delay_ns, __entry->pending)
+);
+
+/* Bis zum Ende des Zeitfensters kam keine fallende Flanke */
+TRACE_EVENT(ultrasonic_timeout,
+	TP_PROTO(unsigned int index),
+	TP_ARGS(index),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+	),
+
+	TP_printk("index=%u", __entry->index)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ultrasonic_trace
+#include <trace/define_trace.h>
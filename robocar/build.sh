@@ -13,18 +13,24 @@ if [ $# -gt 0 ];
     if [[ "$@" == *"-m"* ]]
     then
       echo "Installing Modules"
+      echo "  - Lightbarrier"
+      cd ../drivers/lightbarrier/
+      ./install_modules.sh $1 > /dev/null
       echo "  - Motor"
-      cd ../drivers/motor/
+      cd ../motor/
       ./install_modules.sh $1 > /dev/null
       echo "  - Ultrasonic"
       cd ../ultrasonic/
       ./install_modules.sh $1 > /dev/null
-      echo "  - Lightbarrier"
-      cd ../lightbarrier/
-      ./install_modules.sh $1 > /dev/null
       echo "  - Emergency"
       cd ../emergency/
       ./install_modules.sh $1 > /dev/null
+      echo "  - Linesensor"
+      cd ../linesensor/
+      ./install_modules.sh $1 > /dev/null
+      echo "  - RFID"
+      cd ../rfid/
+      ./install_modules.sh $1 > /dev/null
       cd ../../robocar
     else
         echo -e "\e[33mSkipping Modules Install! Make sure they exist.\033[0m"
@@ -33,6 +39,7 @@ if [ $# -gt 0 ];
     cargo build --release --target=armv7-unknown-linux-gnueabihf
     echo "Copying executable"
     scp target/armv7-unknown-linux-gnueabihf/release/robocar root@$1:/root/
+    scp target/armv7-unknown-linux-gnueabihf/release/latency root@$1:/root/
     if [[ "$@" == *"-l"* ]]
     then
       echo "Generating Load"
@@ -0,0 +1,332 @@
+//! Execution times, periods and schedulability tests from the timing log
+//!
+//! A section of a task starts with the first `n|NAME` marker and ends with the next
+//! marker of the same name (`0|RFID` … `1|RFID`, `1|left` … `2|left`). The main loop
+//! is the exception: `1|MAIN` … `4|END`, the `3|<mode>` marker in between tells which
+//! mode the iteration ran in, so every mode becomes its own task `MAIN <mode>`.
+//!
+//! The main loop is sporadic, events start a job at most `MAIN_MIN_GAP` after the last one.
+//! Its tasksets take that minimum interarrival time instead of the observed one, which only
+//! shows how often events happened to come during the measurement.
+
+use crate::controller::MAIN_MIN_GAP;
+use std::collections::BTreeMap;
+use std::fmt;
+
+/// Sections that only run inside an iteration of the main loop, their time is part of it
+const NESTED: [&str; 3] = ["ULT", "LINES", "SLEEP"];
+/// Sections of threads outside the real-time taskset (SCHED_OTHER, woken by a device),
+/// they are listed with the other tasks but not part of any taskset
+const BACKGROUND_ONLY: [&str; 1] = ["RFID"];
+const MAIN_PREFIX: &str = "MAIN ";
+/// Histogram buckets are powers of two in µs, the last one takes everything above
+pub const BUCKETS: usize = 25;
+
+/// Minimum, maximum and mean of a series in µs
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Stats {
+    pub count: u64,
+    pub min: u64,
+    pub max: u64,
+    sum: u64,
+}
+
+impl Stats {
+    pub fn add(&mut self, value: u64) {
+        if self.count == 0 || value < self.min {
+            self.min = value;
+        }
+        if value > self.max {
+            self.max = value;
+        }
+        self.count += 1;
+        self.sum += value;
+    }
+
+    pub fn mean(&self) -> u64 {
+        if self.count == 0 {
+            0
+        } else {
+            self.sum / self.count
+        }
+    }
+}
+
+#[derive(Clone, Default, Debug)]
+pub struct Task {
+    pub execution: Stats,
+    pub period: Stats,
+    /// `histogram[i]` counts execution times in [2^i, 2^(i+1)) µs, bucket 0 includes 0
+    pub histogram: [u64; BUCKETS],
+    last_start: Option<u64>,
+}
+
+impl Task {
+    fn start(&mut self, time: u64) {
+        if let Some(last) = self.last_start {
+            self.period.add(time.saturating_sub(last));
+        }
+        self.last_start = Some(time);
+    }
+
+    fn finish(&mut self, execution: u64) {
+        self.execution.add(execution);
+        self.histogram[bucket(execution)] += 1;
+    }
+
+    /// tEmax / tPmin
+    pub fn utilization(&self) -> f64 {
+        if self.period.count == 0 || self.period.min == 0 {
+            0.0
+        } else {
+            self.execution.max as f64 / self.period.min as f64
+        }
+    }
+}
+
+/// Histogram bucket of a time in µs
+pub fn bucket(us: u64) -> usize {
+    let bucket = (64 - us.leading_zeros() as usize).saturating_sub(1);
+    bucket.min(BUCKETS - 1)
+}
+
+/// Reads the log line by line, keeps only per-task aggregates
+#[derive(Default)]
+pub struct Analysis {
+    pub tasks: BTreeMap<String, Task>,
+    open: BTreeMap<String, u64>,
+    main_start: Option<u64>,
+    main_mode: Option<String>,
+    /// Start of the previous main loop iteration and its mode, for the period of the mode
+    main_previous: Option<(u64, String)>,
+    pub skipped_lines: u64,
+}
+
+impl Analysis {
+    pub fn new() -> Self {
+        Default::default()
+    }
+
+    /// One line `sec,usec|n|NAME`, anything else is counted and ignored
+    pub fn line(&mut self, line: &str) {
+        match parse(line) {
+            Some((time, number, name)) => self.marker(time, number, name),
+            None => self.skipped_lines += 1,
+        }
+    }
+
+    fn marker(&mut self, time: u64, number: u32, name: &str) {
+        match (number, name) {
+            (1, "MAIN") => self.main_start = Some(time),
+            (3, mode) => self.main_mode = Some(mode.to_string()),
+            (4, "END") => {
+                if let (Some(start), Some(mode)) = (self.main_start.take(), self.main_mode.take()) {
+                    let task = self.tasks.entry(format!("{}{}", MAIN_PREFIX, mode)).or_default();
+                    if let Some((previous, ref previous_mode)) = self.main_previous {
+                        if *previous_mode == mode {
+                            task.period.add(start.saturating_sub(previous));
+                        }
+                    }
+                    task.finish(time.saturating_sub(start));
+                    self.main_previous = Some((start, mode));
+                }
+            }
+            (_, name) => match self.open.remove(name) {
+                Some(start) => self
+                    .tasks
+                    .entry(name.to_string())
+                    .or_default()
+                    .finish(time.saturating_sub(start)),
+                None => {
+                    self.tasks.entry(name.to_string()).or_default().start(time);
+                    self.open.insert(name.to_string(), time);
+                }
+            },
+        }
+    }
+
+    /// Modes seen in the log
+    pub fn modes(&self) -> Vec<&str> {
+        self.tasks
+            .keys()
+            .filter(|name| name.starts_with(MAIN_PREFIX))
+            .map(|name| &name[MAIN_PREFIX.len()..])
+            .collect()
+    }
+
+    /// Periodic tasks that run in every mode next to the main loop
+    fn background(&self) -> impl Iterator<Item = (&String, &Task)> {
+        self.tasks.iter().filter(|(name, task)| {
+            !name.starts_with(MAIN_PREFIX)
+                && !NESTED.contains(&name.as_str())
+                && !BACKGROUND_ONLY.contains(&name.as_str())
+                && task.period.count > 0
+                && task.period.min > 0
+        })
+    }
+
+    /// Background tasks with the observed tEmax and tPmin plus the main loop in `mode`
+    /// with its observed tEmax and `MAIN_MIN_GAP`
+    pub fn taskset(&self, mode: &str) -> Vec<Periodic> {
+        let mut set: Vec<Periodic> = self
+            .background()
+            .filter(|(_, task)| task.period.count > 0 && task.period.min > 0)
+            .map(|(name, task)| Periodic {
+                name: name.clone(),
+                execution: task.execution.max,
+                period: task.period.min,
+            })
+            .chain(
+                self.tasks
+                    .get_key_value(&format!("{}{}", MAIN_PREFIX, mode))
+                    .filter(|(_, task)| task.execution.count > 0)
+                    .map(|(name, task)| Periodic {
+                        name: name.clone(),
+                        execution: task.execution.max,
+                        period: MAIN_MIN_GAP.as_micros() as u64,
+                    }),
+            )
+            .collect();
+        set.sort_by_key(|task| task.period);
+        set
+    }
+}
+
+/// `sec,usec|n|NAME` to (µs, n, NAME)
+fn parse(line: &str) -> Option<(u64, u32, &str)> {
+    let mut parts = line.trim_end().splitn(3, '|');
+    let time = parts.next()?;
+    let number = parts.next()?.parse().ok()?;
+    let name = parts.next()?;
+    let mut time = time.rsplitn(2, ',');
+    let usec: u64 = time.next()?.trim().parse().ok()?;
+    // simplelog may have put something in front of the seconds
+    let sec: u64 = time
+        .next()?
+        .rsplit(|c: char| !c.is_ascii_digit())
+        .next()?
+        .parse()
+        .ok()?;
+    Some((sec * 1_000_000 + usec, number, name))
+}
+
+/// Task with worst case execution time and minimum period (= deadline) in µs
+#[derive(Clone, Debug)]
+pub struct Periodic {
+    pub name: String,
+    pub execution: u64,
+    pub period: u64,
+}
+
+/// Liu & Layland bound n(2^(1/n) - 1) for rate monotonic scheduling on one processor
+pub fn utilization_bound(n: usize) -> f64 {
+    if n == 0 {
+        return 1.0;
+    }
+    n as f64 * (2f64.powf(1.0 / n as f64) - 1.0)
+}
+
+pub fn utilization(set: &[Periodic]) -> f64 {
+    set.iter()
+        .map(|task| task.execution as f64 / task.period as f64)
+        .sum()
+}
+
+/// Worst case response time of `set[index]` under rate monotonic priorities (`set` sorted
+/// by period). `None` if it exceeds the deadline.
+pub fn response_time(set: &[Periodic], index: usize) -> Option<u64> {
+    let task = &set[index];
+    let higher = &set[..index];
+    let mut response = task.execution + higher.iter().map(|t| t.execution).sum::<u64>();
+    loop {
+        if response > task.period {
+            return None;
+        }
+        let next = task.execution
+            + higher
+                .iter()
+                .map(|t| (response + t.period - 1) / t.period * t.execution)
+                .sum::<u64>();
+        if next == response {
+            return Some(response);
+        }
+        response = next;
+    }
+}
+
+/// Milliseconds with three decimals, the unit of the tables in the README
+pub struct Ms(pub u64);
+
+impl fmt::Display for Ms {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "{}.{:03}ms", self.0 / 1000, self.0 % 1000)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn task(name: &str, execution: u64, period: u64) -> Periodic {
+        Periodic {
+            name: name.to_string(),
+            execution,
+            period,
+        }
+    }
+
+    #[test]
+    fn schedulable_below_the_bound() {
+        let set = [task("a", 1, 4), task("b", 1, 5), task("c", 2, 10)];
+        assert!(utilization(&set) <= utilization_bound(set.len()));
+        assert_eq!(response_time(&set, 0), Some(1));
+        assert_eq!(response_time(&set, 1), Some(2));
+        assert_eq!(response_time(&set, 2), Some(4));
+    }
+
+    #[test]
+    fn schedulable_only_by_response_time() {
+        // 83,3% is above the bound for three tasks, the last one still finishes after 10
+        let set = [task("a", 1, 4), task("b", 2, 6), task("c", 3, 12)];
+        assert!(utilization(&set) > utilization_bound(set.len()));
+        assert_eq!(response_time(&set, 2), Some(10));
+    }
+
+    #[test]
+    fn unschedulable() {
+        let set = [task("a", 2, 4), task("b", 3, 6)];
+        assert_eq!(response_time(&set, 0), Some(2));
+        assert_eq!(response_time(&set, 1), None);
+    }
+
+    #[test]
+    fn parses_log_lines() {
+        assert_eq!(
+            parse("1546300800,000250|1|MAIN\n"),
+            Some((1_546_300_800_000_250, 1, "MAIN"))
+        );
+        assert_eq!(
+            parse("12:00:00 [INFO] 1546300800,250|0|RFID"),
+            Some((1_546_300_800_000_250, 0, "RFID"))
+        );
+        assert_eq!(parse("Could not open /dev/rfid"), None);
+
+        let mut analysis = Analysis::new();
+        for line in &[
+            "1546300800,000000|1|MAIN",
+            "1546300800,000100|3|Follow Line",
+            "1546300800,000300|4|END",
+            "1546300800,020000|1|MAIN",
+            "1546300800,020100|3|Follow Line",
+            "1546300800,020200|4|END",
+            "not a marker",
+        ] {
+            analysis.line(line);
+        }
+        let main = &analysis.tasks["MAIN Follow Line"];
+        assert_eq!((main.execution.min, main.execution.max), (200, 300));
+        assert_eq!(main.period.min, 20_000);
+        assert_eq!(analysis.skipped_lines, 1);
+        assert_eq!(analysis.modes(), vec!["Follow Line"]);
+    }
+}
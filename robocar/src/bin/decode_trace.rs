@@ -0,0 +1,23 @@
+//! Turns the binary trace of the robocar into the text format of the old `/tmp/timing.log`
+//!
+//! `decode_trace [trace file] > timing.log`, the default is `/tmp/timing.trace`
+
+use robocar::logging::{read_records, TRACE_FILE};
+use std::fs::File;
+use std::io::{stdout, BufWriter, Write};
+
+fn main() {
+    let path = std::env::args().nth(1).unwrap_or_else(|| TRACE_FILE.to_string());
+    let file = File::open(&path).expect(&format!("Could not open {}", path));
+    let out = stdout();
+    let mut out = BufWriter::new(out.lock());
+    let mut unknown = 0;
+    read_records(file, |record| match record.to_line() {
+        Some(line) => writeln!(out, "{}", line).expect("Could not write to stdout"),
+        None => unknown += 1,
+    })
+    .expect(&format!("Could not read {}", path));
+    if unknown > 0 {
+        eprintln!("Skipped {} records with unknown event ids", unknown);
+    }
+}
@@ -0,0 +1,184 @@
+//! Latency from the hard interrupt of a sensor edge until a program has read the event
+//!
+//! `latency [seconds]`, runs on the car instead of `robocar` (60 s by default) with the
+//! priority of the main loop. Start the load of `build.sh -l` first to get the worst
+//! case of the RT kernel. The drivers stamp every event in the hard interrupt, per
+//! source this prints how long it took until
+//! - the threaded handler of the driver ran (IRQ → handler, measured by the driver, not
+//!   reported by the line sensors)
+//! - `read()` returned here (IRQ → read)
+
+#[path = "../hardware.rs"]
+#[allow(dead_code)]
+mod hardware;
+
+use hardware::{Device, LineState};
+use robocar::analysis::{bucket, Ms, Stats, BUCKETS};
+use robocar::car::Sample;
+use robocar::periodic::{self, now_ns, Runtime};
+use std::os::unix::io::AsRawFd;
+use std::time::Duration;
+
+enum Kind {
+    Ultrasonic,
+    Lightbarrier,
+    Linesensor,
+    Emergency,
+}
+
+#[derive(Default)]
+struct Latency {
+    stats: Stats,
+    histogram: [u64; BUCKETS],
+}
+
+impl Latency {
+    fn add(&mut self, ns: u64) {
+        let us = ns / 1000;
+        self.stats.add(us);
+        self.histogram[bucket(us)] += 1;
+    }
+}
+
+struct Source {
+    name: &'static str,
+    kind: Kind,
+    device: Device,
+    to_handler: Latency,
+    to_read: Latency,
+}
+
+impl Source {
+    fn new(name: &'static str, kind: Kind) -> Self {
+        Source {
+            name,
+            kind,
+            device: Device::new(&format!("/dev/{}", name)),
+            to_handler: Latency::default(),
+            to_read: Latency::default(),
+        }
+    }
+
+    /// Reads what is pending, the device has to be readable
+    fn read(&mut self) {
+        match self.kind {
+            Kind::Ultrasonic => {
+                let mut samples = [Sample::default(); 32];
+                let count = self.device.read_samples(&mut samples);
+                let now = now_ns();
+                for sample in samples[..count].iter().filter(|s| s.is_valid()) {
+                    self.to_handler.add(sample.handler_delay_ns as u64);
+                    self.to_read.add(now.saturating_sub(sample.timestamp_ns));
+                }
+            }
+            Kind::Lightbarrier => {
+                let ticks = self.device.read_ticks();
+                let now = now_ns();
+                self.to_handler.add(ticks.handler_delay_ns as u64);
+                self.to_read.add(now.saturating_sub(ticks.last_tick_ns));
+            }
+            Kind::Linesensor => {
+                let state: LineState = self.device.read_record();
+                let now = now_ns();
+                let newest = state.changed_ns.iter().cloned().max().unwrap_or(0);
+                self.to_read.add(now.saturating_sub(newest));
+            }
+            Kind::Emergency => {
+                let press = self.device.read_press();
+                let now = now_ns();
+                self.to_handler.add(press.handler_delay_ns as u64);
+                self.to_read.add(now.saturating_sub(press.timestamp_ns));
+            }
+        }
+    }
+}
+
+fn main() {
+    let seconds = std::env::args()
+        .nth(1)
+        .map(|arg| arg.parse().expect("Usage: latency [seconds]"))
+        .unwrap_or(60);
+
+    let runtime = Runtime::new(0, &[("MAIN", Duration::from_millis(20))]);
+    periodic::setup_sched(0, runtime.priority("MAIN"));
+
+    let mut sources = vec![
+        Source::new("ultrasonic-left", Kind::Ultrasonic),
+        Source::new("ultrasonic-right", Kind::Ultrasonic),
+        Source::new("lightbarrier-left", Kind::Lightbarrier),
+        Source::new("lightbarrier-right", Kind::Lightbarrier),
+        Source::new("linesensor", Kind::Linesensor),
+        Source::new("emergency", Kind::Emergency),
+    ];
+    let mut fds: Vec<libc::pollfd> = sources
+        .iter()
+        .map(|source| libc::pollfd {
+            fd: source.device.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        })
+        .collect();
+
+    eprintln!(
+        "Measuring for {} s, turn the wheels, cross a line and press the emergency button",
+        seconds
+    );
+    let end = now_ns() + seconds * 1_000_000_000;
+    while now_ns() < end {
+        let ready = unsafe { libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, 100) };
+        if ready <= 0 {
+            continue;
+        }
+        for (source, fd) in sources.iter_mut().zip(fds.iter()) {
+            if fd.revents & libc::POLLIN != 0 {
+                source.read();
+            }
+        }
+    }
+
+    print_table(&sources);
+    for source in &sources {
+        print_histogram(source.name, &source.to_read);
+    }
+}
+
+fn print_table(sources: &[Source]) {
+    println!(
+        "{:<20} {:>8} {:>12} {:>12} {:>12} {:>12} {:>12} {:>12}",
+        "Source", "Count", "handler min", "mean", "max", "read min", "mean", "max"
+    );
+    for source in sources {
+        let (handler, read) = (&source.to_handler.stats, &source.to_read.stats);
+        println!(
+            "{:<20} {:>8} {:>12} {:>12} {:>12} {:>12} {:>12} {:>12}",
+            source.name,
+            read.count,
+            Ms(handler.min).to_string(),
+            Ms(handler.mean()).to_string(),
+            Ms(handler.max).to_string(),
+            Ms(read.min).to_string(),
+            Ms(read.mean()).to_string(),
+            Ms(read.max).to_string()
+        );
+    }
+}
+
+fn print_histogram(name: &str, latency: &Latency) {
+    if latency.stats.count == 0 {
+        return;
+    }
+    println!();
+    println!("IRQ -> read of {}", name);
+    let largest = latency.histogram.iter().cloned().max().unwrap_or(0).max(1);
+    for (bucket, &count) in latency.histogram.iter().enumerate() {
+        if count == 0 {
+            continue;
+        }
+        println!(
+            "  >= {:>10} {:>8} {}",
+            Ms(if bucket == 0 { 0 } else { 1 << bucket }).to_string(),
+            count,
+            "#".repeat((count * 50 / largest) as usize)
+        );
+    }
+}
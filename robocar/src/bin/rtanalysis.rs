@@ -0,0 +1,138 @@
+//! Real-time proof from a timing log: execution times, periods, utilization and the
+//! schedulability tests of every mode's taskset
+//!
+//! `rtanalysis [timing.log | timing.trace]`, reads the text log from stdin without argument.
+//! Files ending in `.trace` are decoded like `decode_trace` does.
+
+use robocar::analysis::*;
+use robocar::logging::read_records;
+use std::fs::File;
+use std::io::{stdin, BufRead, BufReader};
+
+fn main() {
+    let mut analysis = Analysis::new();
+    match std::env::args().nth(1) {
+        Some(ref path) if path.ends_with(".trace") => {
+            let file = File::open(path).expect(&format!("Could not open {}", path));
+            read_records(file, |record| {
+                if let Some(line) = record.to_line() {
+                    analysis.line(&line);
+                }
+            })
+            .expect(&format!("Could not read {}", path));
+        }
+        Some(path) => {
+            let file = File::open(&path).expect(&format!("Could not open {}", path));
+            for line in BufReader::new(file).lines() {
+                analysis.line(&line.expect(&format!("Could not read {}", path)));
+            }
+        }
+        None => {
+            let input = stdin();
+            for line in input.lock().lines() {
+                analysis.line(&line.expect("Could not read stdin"));
+            }
+        }
+    }
+
+    print_tasks(&analysis);
+    for mode in analysis.modes() {
+        print_taskset(mode, &analysis.taskset(mode));
+    }
+    if analysis.skipped_lines > 0 {
+        eprintln!("Skipped {} lines without a marker", analysis.skipped_lines);
+    }
+}
+
+fn print_tasks(analysis: &Analysis) {
+    println!(
+        "{:<22} {:>8} {:>12} {:>12} {:>12} {:>12} {:>12} {:>10}",
+        "Task", "Count", "tEmin", "tEmean", "tEmax", "tPmin", "tPmax", "Util"
+    );
+    for (name, task) in &analysis.tasks {
+        println!(
+            "{:<22} {:>8} {:>12} {:>12} {:>12} {:>12} {:>12} {:>9.3}%",
+            name,
+            task.execution.count,
+            Ms(task.execution.min).to_string(),
+            Ms(task.execution.mean()).to_string(),
+            Ms(task.execution.max).to_string(),
+            Ms(task.period.min).to_string(),
+            Ms(task.period.max).to_string(),
+            task.utilization() * 100.0
+        );
+    }
+
+    for (name, task) in &analysis.tasks {
+        println!();
+        println!("Execution times of {}", name);
+        let largest = task.histogram.iter().cloned().max().unwrap_or(0).max(1);
+        for (bucket, &count) in task.histogram.iter().enumerate() {
+            if count == 0 {
+                continue;
+            }
+            println!(
+                "  >= {:>10} {:>8} {}",
+                Ms(if bucket == 0 { 0 } else { 1 << bucket }).to_string(),
+                count,
+                "#".repeat((count * 50 / largest) as usize)
+            );
+        }
+    }
+}
+
+fn print_taskset(mode: &str, set: &[Periodic]) {
+    println!();
+    println!("Taskset {}", mode);
+    if set.is_empty() {
+        println!("  no periodic tasks");
+        return;
+    }
+    for task in set {
+        println!(
+            "  {:<22} tEmax {:>12} tPmin/tDmax {:>12}",
+            task.name,
+            Ms(task.execution).to_string(),
+            Ms(task.period).to_string()
+        );
+    }
+
+    let total = utilization(set);
+    let bound = utilization_bound(set.len());
+    println!(
+        "  Sufficient: U = {:.3}% {} {:.3}% (Liu & Layland, n = {}) -> {}",
+        total * 100.0,
+        if total <= bound { "<=" } else { ">" },
+        bound * 100.0,
+        set.len(),
+        if total <= bound { "schedulable" } else { "not proven" }
+    );
+
+    let mut schedulable = true;
+    for (index, task) in set.iter().enumerate() {
+        match response_time(set, index) {
+            Some(response) => println!(
+                "  Necessary: {:<22} tRmax {:>12} <= {}",
+                task.name,
+                Ms(response).to_string(),
+                Ms(task.period)
+            ),
+            None => {
+                schedulable = false;
+                println!(
+                    "  Necessary: {:<22} tRmax exceeds the deadline {}",
+                    task.name,
+                    Ms(task.period)
+                );
+            }
+        }
+    }
+    println!(
+        "  -> {}",
+        if schedulable {
+            "all deadlines met"
+        } else {
+            "deadline missed"
+        }
+    );
+}
@@ -0,0 +1,349 @@
+//! Runs the control logic of the main loop against the simulated car on the host
+//!
+//! `simulate [--realtime] [seconds]`, drives a test course for 30 s of simulated time by
+//! default, as fast as the computer can. With `--realtime` every period takes as long
+//! as on the car. A second course runs the Straight mode, then the speed controller gets
+//! a step from 0 to 300 mm/s. Panics if a course does not end as expected.
+
+use robocar::car::Car;
+use robocar::controller::*;
+use robocar::mode::Mode;
+use robocar::sim::*;
+use std::f64::consts::PI;
+use std::sync::atomic::AtomicUsize;
+use std::thread;
+use std::time::{Duration, Instant};
+
+/// Period of the main loop, the same as in main.rs
+const PERIOD: Duration = Duration::from_millis(20);
+const TARGET_MM_PER_S: i32 = 300;
+/// The speed counts as reached when it stays this close to the target
+const TOLERANCE: f64 = 0.05;
+const SETTLE: Duration = Duration::from_millis(500);
+/// Default length of the course run, it reaches the end of the lane after about 20 s
+const COURSE_SECONDS: u64 = 30;
+
+/// Simulated time for the Straight course, enough for all of its phases
+const STRAIGHT_SECONDS: u64 = 15;
+/// Lines the Straight mode counts before it stops, see `controller`
+const STRAIGHT_LINES: usize = 8;
+/// A line takes two hold-offs of 200 ms to count, at 300 mm/s the rings have to be
+/// further apart than that
+const RING_SPACING_MM: f64 = 150.0;
+
+fn ring_radius(ring: usize) -> f64 {
+    ring as f64 * RING_SPACING_MM
+}
+
+static MODE: AtomicUsize = AtomicUsize::new(Mode::Idle as usize);
+
+fn segment(x1: f64, y1: f64, x2: f64, y2: f64) -> Segment {
+    Segment::new(Point::new(x1, y1), Point::new(x2, y2))
+}
+
+fn tag(x: f64, y: f64, uid: [u8; 4]) -> Tag {
+    Tag {
+        position: Point::new(x, y),
+        uid,
+    }
+}
+
+/// Closed polygon around `center`, fine enough to pass for a circle
+fn circle(center: Point, radius: f64) -> Vec<Segment> {
+    const CORNERS: usize = 64;
+    let corner = |i: usize| {
+        let angle = 2.0 * PI * i as f64 / CORNERS as f64;
+        Point::new(
+            center.x + radius * angle.cos(),
+            center.y + radius * angle.sin(),
+        )
+    };
+    (0..CORNERS)
+        .map(|i| Segment::new(corner(i), corner(i + 1)))
+        .collect()
+}
+
+/// Lane of the BetweenLines part, it bends slightly to the left so the car has to steer
+const LANE_START_X: f64 = 5000.0;
+const LANE_END_X: f64 = 6300.0;
+const LANE_HALF_WIDTH_MM: f64 = 50.0;
+const LANE_SLOPE: f64 = 0.09;
+
+fn lane_center(x: f64) -> f64 {
+    (x - LANE_START_X).max(0.0) * LANE_SLOPE
+}
+
+/// A corridor for wall following, a line to follow and a lane between two lines that
+/// ends in front of a wall
+fn course() -> World {
+    let lane = |side: f64| {
+        segment(
+            LANE_START_X,
+            side * LANE_HALF_WIDTH_MM,
+            LANE_END_X,
+            lane_center(LANE_END_X) + side * LANE_HALF_WIDTH_MM,
+        )
+    };
+    World {
+        walls: vec![
+            segment(-200.0, 300.0, 3000.0, 300.0),
+            segment(-200.0, -300.0, 3000.0, -300.0),
+            segment(6500.0, -500.0, 6500.0, 500.0),
+        ],
+        lines: vec![
+            segment(3000.0, 0.0, LANE_START_X, 0.0),
+            lane(1.0),
+            lane(-1.0),
+        ],
+        tags: vec![
+            tag(0.0, 0.0, WALL_FOLLOWING),
+            tag(3000.0, 0.0, LINE_FOLLOWING),
+            tag(LANE_START_X, 0.0, BETWEEN_LINES),
+        ],
+    }
+}
+
+/// The car turns on the spot about its left wheel, so that is where the course is centered
+fn straight_pivot() -> Point {
+    Point::new(0.0, 65.0)
+}
+
+/// Round arena for Straight: the turn and the alignment see the wall at the same
+/// distance in every direction, the car then crosses rings of tape on its way out
+fn straight_course() -> World {
+    let pivot = straight_pivot();
+    World {
+        walls: circle(pivot, 1500.0),
+        lines: (1..=STRAIGHT_LINES + 1)
+            .flat_map(|ring| circle(pivot, ring_radius(ring)))
+            .collect(),
+        tags: vec![tag(0.0, 0.0, STRAIGHT)],
+    }
+}
+
+fn main() {
+    let mut realtime = false;
+    let mut seconds = COURSE_SECONDS;
+    for arg in std::env::args().skip(1) {
+        if arg == "--realtime" {
+            realtime = true;
+        } else {
+            seconds = arg.parse().expect("Usage: simulate [--realtime] [seconds]");
+        }
+    }
+
+    let (sim, mode) = drive_course(course(), Duration::from_secs(seconds), realtime);
+    // Shorter runs stop somewhere on the course
+    if seconds >= COURSE_SECONDS {
+        let pose = sim.pose();
+        assert_eq!(mode, Mode::BetweenLines, "The course ended in {}", mode);
+        assert!(
+            pose.position.x > LANE_END_X - 500.0,
+            "BetweenLines stopped at x {:.0} mm",
+            pose.position.x
+        );
+        assert!(
+            (pose.position.y - lane_center(pose.position.x)).abs() < LANE_HALF_WIDTH_MM,
+            "BetweenLines left the lane at y {:.0} mm",
+            pose.position.y
+        );
+    }
+
+    println!();
+    let (sim, mode) = drive_course(
+        straight_course(),
+        Duration::from_secs(STRAIGHT_SECONDS),
+        realtime,
+    );
+    // The line sensors are ahead of the center, so the car stops with them past the
+    // last ring it counts and its center before the ring after that
+    let out = sim.pose().position;
+    let pivot = straight_pivot();
+    let radius = (out.x - pivot.x).hypot(out.y - pivot.y);
+    assert_eq!(
+        mode,
+        Mode::Idle,
+        "Straight did not finish, still in {}",
+        mode
+    );
+    assert!(
+        radius > ring_radius(STRAIGHT_LINES - 1) && radius < ring_radius(STRAIGHT_LINES + 1),
+        "Straight stopped {:.0} mm from the center instead of after {} lines",
+        radius,
+        STRAIGHT_LINES
+    );
+    println!(
+        "Straight: stopped after {} lines, {:.0} mm from the center",
+        STRAIGHT_LINES, radius
+    );
+
+    step_response();
+}
+
+/// Returns the simulation and the mode at the end
+fn drive_course(world: World, duration: Duration, realtime: bool) -> (Simulation, Mode) {
+    let sim = Simulation::new(world, Pose::default());
+    let mut controller = Controller::new(&MODE);
+    controller.set_mode(Mode::Idle);
+    let period = PERIOD.as_nanos() as u64;
+    let end = sim.now_ns() + duration.as_nanos() as u64;
+    let mut release = sim.now_ns();
+    let mut pending: Vec<(u64, Mode)> = Vec::new();
+    let mut latency = Latency::default();
+    let mut overruns = 0;
+    let started = Instant::now();
+
+    println!(
+        "{:>10}  {:<16} {:>8} {:>8}",
+        "Time", "Mode", "x [mm]", "y [mm]"
+    );
+    report_mode(&sim, controller.mode());
+    while sim.now_ns() < end {
+        // Cards switch the mode between two steps, on the car the RFID thread can
+        // also do it while a step runs
+        while let Some(card) = sim.take_card() {
+            if let Some((mode, delay)) = card_mode(card.uid()) {
+                pending.push((card.timestamp_ns + delay.as_nanos() as u64, mode));
+            }
+        }
+        let now = sim.now_ns();
+        for &(_, mode) in pending.iter().filter(|&&(time, _)| time <= now) {
+            controller.set_mode(mode);
+            report_mode(&sim, mode);
+        }
+        pending.retain(|&(time, _)| time > now);
+
+        let before = controller.mode();
+        let begin = Instant::now();
+        controller.step(&sim);
+        latency.add(begin.elapsed());
+        if controller.mode() != before {
+            report_mode(&sim, controller.mode());
+        }
+
+        release += period;
+        if sim.now_ns() >= release {
+            let missed = (sim.now_ns() - release) / period + 1;
+            overruns += missed;
+            release += missed * period;
+        }
+        let remaining = Duration::from_nanos(release - sim.now_ns());
+        sim.advance(remaining);
+        if realtime {
+            thread::sleep(remaining);
+        }
+    }
+
+    let elapsed = started.elapsed();
+    report_mode(&sim, controller.mode());
+    println!();
+    println!(
+        "Simulated {:.1} s in {:.3} s ({:.0}x), {} steps, {} releases overrun",
+        duration.as_secs_f64(),
+        elapsed.as_secs_f64(),
+        duration.as_secs_f64() / elapsed.as_secs_f64(),
+        latency.count,
+        overruns
+    );
+    println!(
+        "Step on the host: min {:.1} us, mean {:.1} us, max {:.1} us",
+        latency.min.as_nanos() as f64 / 1000.0,
+        latency.mean().as_nanos() as f64 / 1000.0,
+        latency.max.as_nanos() as f64 / 1000.0
+    );
+    let pose = sim.pose();
+    let odometry = sim.odometry();
+    println!(
+        "Odometry: x {:.0} mm, y {:.0} mm, heading {:.1} deg after {:.0} mm, off by {:.0} mm",
+        odometry.x_mm,
+        odometry.y_mm,
+        odometry.heading.to_degrees(),
+        odometry.travelled_mm,
+        (odometry.x_mm - pose.position.x).hypot(odometry.y_mm - pose.position.y)
+    );
+    let mode = controller.mode();
+    (sim, mode)
+}
+
+fn report_mode(sim: &Simulation, mode: Mode) {
+    let pose = sim.pose();
+    println!(
+        "{:>8.3} s  {:<16} {:>8.0} {:>8.0}",
+        sim.now_ns() as f64 / 1e9,
+        mode.to_string(),
+        pose.position.x,
+        pose.position.y
+    );
+}
+
+/// Step of the kernel speed controller from standstill to `TARGET_MM_PER_S`
+fn step_response() {
+    let sim = Simulation::new(World::default(), Pose::default());
+    let start = sim.now_ns();
+    let step = Duration::from_millis(10);
+    let target = TARGET_MM_PER_S as f64;
+    let mut overshoot: f64 = 0.0;
+    let mut inside_since = None;
+
+    sim.set_target_and_estimate(TARGET_MM_PER_S, TARGET_MM_PER_S);
+    while sim.now_ns() - start < 10_000_000_000 {
+        sim.advance(step);
+        let speeds = sim.wheel_speeds();
+        let slowest = speeds[0].min(speeds[1]);
+        let fastest = speeds[0].max(speeds[1]);
+        overshoot = overshoot.max(fastest - target);
+        if (slowest - target).abs() <= target * TOLERANCE
+            && (fastest - target).abs() <= target * TOLERANCE
+        {
+            let since = *inside_since.get_or_insert(sim.now_ns());
+            if sim.now_ns() - since >= SETTLE.as_nanos() as u64 {
+                break;
+            }
+        } else {
+            inside_since = None;
+        }
+    }
+
+    println!();
+    match inside_since {
+        Some(time) => println!(
+            "Speed controller: 0 -> {} mm/s within {:.0}% after {} ms, overshoot {:.0} mm/s",
+            TARGET_MM_PER_S,
+            TOLERANCE * 100.0,
+            (time - start) / 1_000_000,
+            overshoot
+        ),
+        None => println!(
+            "Speed controller: did not settle at {} mm/s within 10 s, wheels at {:?} mm/s",
+            TARGET_MM_PER_S,
+            sim.wheel_speeds()
+        ),
+    }
+}
+
+#[derive(Default)]
+struct Latency {
+    count: u32,
+    min: Duration,
+    max: Duration,
+    total: Duration,
+}
+
+impl Latency {
+    fn add(&mut self, time: Duration) {
+        if self.count == 0 || time < self.min {
+            self.min = time;
+        }
+        self.max = self.max.max(time);
+        self.total += time;
+        self.count += 1;
+    }
+
+    fn mean(&self) -> Duration {
+        if self.count == 0 {
+            Duration::from_secs(0)
+        } else {
+            self.total / self.count
+        }
+    }
+}
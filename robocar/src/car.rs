@@ -0,0 +1,162 @@
+//! What the control logic sees of the car, independent of real or simulated hardware
+
+use crate::odometry::Estimate;
+
+/// Echo within range, `echo_us` and `distance_mm` are valid
+pub const SAMPLE_VALID: u32 = 0x1;
+/// No echo arrived in time
+pub const SAMPLE_TIMEOUT: u32 = 0x2;
+/// The driver dropped samples before this one
+pub const SAMPLE_OVERFLOW: u32 = 0x4;
+/// Echo outside the range of the sensor, most likely a disturbance
+pub const SAMPLE_OUT_OF_RANGE: u32 = 0x8;
+/// `filtered_mm` is valid
+pub const SAMPLE_FILTERED: u32 = 0x10;
+/// Together with `SAMPLE_OUT_OF_RANGE`: echo below the minimum range, something is right in front
+pub const SAMPLE_TOO_CLOSE: u32 = 0x20;
+
+/// `echo_us` of a timeout
+const ECHO_TIMEOUT_US: u32 = 200_000;
+/// Speed of sound the driver uses by default, in mm/s
+const SPEED_OF_SOUND: u64 = 343_000;
+
+/// One ultrasonic measurement as queued by the kernel module
+#[repr(C)]
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Sample {
+    /// Falling edge of the echo in the hard interrupt
+    pub timestamp_ns: u64,
+    pub sequence: u32,
+    pub echo_us: u32,
+    pub flags: u32,
+    /// From the hard interrupt to the threaded handler, 0 for timeouts
+    pub handler_delay_ns: u32,
+    /// Distance of this measurement, 0 without echo
+    pub distance_mm: u32,
+    /// Median over the recent measurements, see `distance_mm()`
+    pub filtered_mm: u32,
+}
+
+impl Sample {
+    /// Measurement of a sensor without noise, `None` is a timeout
+    pub fn new(timestamp_ns: u64, sequence: u32, distance_mm: Option<u32>) -> Self {
+        let mut sample = Sample {
+            timestamp_ns,
+            sequence,
+            echo_us: ECHO_TIMEOUT_US,
+            flags: SAMPLE_TIMEOUT,
+            ..Default::default()
+        };
+        if let Some(distance) = distance_mm {
+            sample.echo_us = (distance as u64 * 2_000_000 / SPEED_OF_SOUND) as u32;
+            sample.flags = SAMPLE_VALID | SAMPLE_FILTERED;
+            sample.distance_mm = distance;
+            sample.filtered_mm = distance;
+        }
+        sample
+    }
+
+    pub fn is_valid(&self) -> bool {
+        self.flags & SAMPLE_VALID != 0
+    }
+
+    /// Echo too short to measure, the obstacle is closer than the minimum range
+    pub fn is_too_close(&self) -> bool {
+        self.flags & SAMPLE_TOO_CLOSE != 0
+    }
+
+    /// Filtered distance, `None` while the driver has too few valid measurements.
+    /// The median lags a step in distance by (window - 1) / 2 measurements.
+    pub fn distance_mm(&self) -> Option<u32> {
+        if self.flags & SAMPLE_FILTERED != 0 {
+            Some(self.filtered_mm)
+        } else {
+            None
+        }
+    }
+}
+
+/// Latest state of one wheel in the lightbarrier snapshot page
+#[repr(C)]
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Wheel {
+    pub ticks: i32,
+    /// Filtered speed in mm/s at the time of `last_tick_ns`
+    pub velocity_mm_per_s: u32,
+    pub last_tick_ns: u64,
+    pub period_ns: u64,
+}
+
+/// Everything the main loop needs from the sensors in one copy, index 0 is left, 1 is right
+#[derive(Clone, Copy, Default, Debug)]
+pub struct CarState {
+    pub ultrasonic: [Sample; 2],
+    pub wheels: [Wheel; 2],
+}
+
+/// IR line sensors from left to right, `true` while the sensor sees a line
+#[derive(Clone, Copy, Default, Debug, PartialEq)]
+pub struct Lines {
+    pub left: bool,
+    pub middle_left: bool,
+    pub middle_right: bool,
+    pub right: bool,
+}
+
+impl Lines {
+    /// From the bitmask of the linesensor module, bit 0 is the left sensor
+    pub fn from_mask(mask: u32) -> Self {
+        Lines {
+            left: mask & 1 != 0,
+            middle_left: mask & 2 != 0,
+            middle_right: mask & 4 != 0,
+            right: mask & 8 != 0,
+        }
+    }
+}
+
+/// A card that entered the field, `struct rfid_event` from drivers/rfid/rfid.h
+#[repr(C)]
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Card {
+    pub timestamp_ns: u64,
+    uid_size: u8,
+    pub sak: u8,
+    uid: [u8; 10],
+    pub flags: u8,
+    reserved: [u8; 3],
+}
+
+impl Card {
+    pub fn new(timestamp_ns: u64, uid: &[u8]) -> Self {
+        let mut card = Card {
+            timestamp_ns,
+            uid_size: uid.len().min(10) as u8,
+            ..Default::default()
+        };
+        card.uid[..card.uid_size as usize].copy_from_slice(&uid[..card.uid_size as usize]);
+        card
+    }
+
+    pub fn uid(&self) -> &[u8] {
+        &self.uid[..(self.uid_size as usize).min(self.uid.len())]
+    }
+}
+
+/// Sensors, motors and clock of the car. Implemented by the kernel modules in
+/// `hardware.rs` and by the physics model in `sim.rs`.
+pub trait Car {
+    fn read(&self) -> CarState;
+    fn lines(&self) -> Lines;
+    /// Latest dead reckoning estimate, updated with every lightbarrier tick
+    fn odometry(&self) -> Estimate;
+    /// Direct PWM values in % for both motors at once
+    fn set_direct_speed(&self, left: i32, right: i32);
+    /// Direct PWM value in % for the left motor only
+    fn set_direct_speed_left(&self, speed: i32);
+    /// Speed targets in mm/s for the speed controller
+    fn set_target_and_estimate(&self, left: i32, right: i32);
+    /// Clock for timed phases of the control logic in ns, CLOCK_MONOTONIC on the car
+    /// and the simulated time in the simulation
+    fn now_ns(&self) -> u64;
+}
@@ -0,0 +1,283 @@
+//! Control logic of the main loop, runs against any `Car`
+
+use crate::car::{Car, Lines, Sample};
+use crate::logging::{trace, Event};
+use crate::mode::Mode;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::Duration;
+
+pub const WALL_FOLLOWING: [u8; 4] = [174, 11, 30, 43];
+pub const BETWEEN_LINES: [u8; 4] = [186, 23, 207, 41];
+pub const STRAIGHT: [u8; 4] = [183, 25, 34, 43];
+pub const LINE_FOLLOWING: [u8; 4] = [125, 239, 33, 43];
+pub const TOP_OF_RAMP: [u8; 4] = [195, 136, 144, 26];
+pub const END_OF_RAMP: [u8; 4] = [193, 76, 3, 32];
+
+/// Timer release of the main loop, the safety checks run at least this often
+pub const MAIN_PERIOD: Duration = Duration::from_millis(20);
+/// Minimum gap between two jobs of the main loop. Sensor events and mode changes start a
+/// job right away, so this and not `MAIN_PERIOD` is its interarrival time in the real-time proof.
+pub const MAIN_MIN_GAP: Duration = Duration::from_millis(1);
+
+/// No echo counts as far away, beyond the range of the sensors
+const FAR_MM: i32 = 10_000;
+
+/// Filtered distance of a sample in mm. Without a filtered value an echo below
+/// the minimum range counts as touching, anything else (timeouts, too few
+/// valid measurements) as far away.
+fn distance_mm(sample: &Sample) -> i32 {
+    match sample.distance_mm() {
+        Some(distance) => distance as i32,
+        None if sample.is_too_close() => 0,
+        None => FAR_MM,
+    }
+}
+
+/// Mode a card switches to and how long after reading it
+pub fn card_mode(uid: &[u8]) -> Option<(Mode, Duration)> {
+    if uid == WALL_FOLLOWING {
+        Some((Mode::WallFollowing, Duration::from_millis(0)))
+    } else if uid == LINE_FOLLOWING {
+        Some((Mode::LineFollowing, Duration::from_millis(0)))
+    } else if uid == BETWEEN_LINES {
+        Some((Mode::BetweenLines, Duration::from_millis(0)))
+    } else if uid == STRAIGHT {
+        Some((Mode::Straight, Duration::from_millis(0)))
+    } else if uid == END_OF_RAMP {
+        // The car has to leave the ramp before it turns
+        Some((Mode::EndOfRamp, Duration::from_millis(400)))
+    } else if uid == TOP_OF_RAMP {
+        Some((Mode::TopOfRamp, Duration::from_millis(0)))
+    } else {
+        None
+    }
+}
+
+/// Durations of the Straight phases in ns
+const KICK_NS: u64 = 50_000_000;
+const TURN_NS: u64 = 3_000_000_000;
+const ALIGN_SAMPLE_NS: u64 = 15_000_000;
+const BRAKE_NS: u64 = 1_000_000_000;
+const LINE_SAMPLE_NS: u64 = 5_000_000;
+/// After a line edge the next one is ignored for this long
+const LINE_HOLDOFF_NS: u64 = 200_000_000;
+
+/// Phases of the Straight mode. Every step only checks whether the phase is over, so
+/// a step never waits and the distance guard and mode changes act right away.
+#[derive(Clone, Copy, PartialEq, Debug)]
+enum Straight {
+    /// Left wheel backwards to turn on the spot
+    Kick { until: u64 },
+    /// Right wheel under speed control
+    Turn { until: u64 },
+    /// Until both distances stay between 1250 and 1500 mm for 12 samples
+    Align { same: u32, next: u64 },
+    Brake { until: u64 },
+    /// Drives on and counts the lines below the middle left sensor, stops at the 8th
+    CountLines { count: u32, last: bool, next: u64 },
+}
+
+pub struct Controller<'a> {
+    mode: &'a AtomicUsize,
+    /// Phase of the Straight mode, `None` outside of it
+    straight: Option<Straight>,
+}
+
+impl<'a> Controller<'a> {
+    /// `mode` is shared with whoever switches modes (RFID, emergency button)
+    pub fn new(mode: &'a AtomicUsize) -> Self {
+        Controller {
+            mode,
+            straight: None,
+        }
+    }
+
+    pub fn mode(&self) -> Mode {
+        self.mode.load(Ordering::SeqCst).into()
+    }
+
+    pub fn set_mode(&self, mode: Mode) {
+        self.mode.store(mode as usize, Ordering::SeqCst);
+    }
+
+    /// One iteration of the main loop, returns the mode it ran in. Never blocks, timed
+    /// phases continue in the next iteration.
+    pub fn step<C: Car>(&mut self, car: &C) -> Mode {
+        trace(Event::MainBegin, 0);
+        let mode = self.mode();
+        if mode != Mode::Straight {
+            self.straight = None;
+        }
+
+        let state = car.read();
+        let left_distance = distance_mm(&state.ultrasonic[0]);
+        let right_distance = distance_mm(&state.ultrasonic[1]);
+
+        match mode {
+            Mode::WallFollowing => {
+                if left_distance < 50 {
+                    car.set_direct_speed(60, -60);
+                } else if right_distance < 50 {
+                    car.set_direct_speed(-60, 60);
+                } else if left_distance - right_distance > 300 {
+                    car.set_direct_speed(0, 60);
+                } else if left_distance - right_distance < -300 {
+                    car.set_direct_speed(60, 0);
+                } else {
+                    car.set_direct_speed(60, 60);
+                }
+            }
+            Mode::LineFollowing => {
+                let lines = car.lines();
+                if lines.left {
+                    car.set_direct_speed(-60, 60);
+                } else if lines.right {
+                    car.set_direct_speed(60, -60);
+                } else {
+                    car.set_direct_speed(100, 100);
+                }
+            }
+            Mode::Straight => self.straight(car),
+            Mode::BetweenLines => between_lines(car, 100, 0, false),
+            Mode::Idle => {
+                car.set_direct_speed(0, 0);
+            }
+            Mode::EndOfRamp => between_lines(car, -15, -100, true),
+            Mode::TopOfRamp => between_lines(car, 60, 0, false),
+        }
+
+        trace(Event::ModeEnd, mode as u32);
+
+        if mode != Mode::Idle && mode != Mode::WallFollowing && mode != Mode::EndOfRamp {
+            if left_distance < 250 || right_distance < 250 {
+                car.set_direct_speed(0, 0);
+            }
+        }
+
+        trace(Event::MainEnd, 0);
+        mode
+    }
+
+    fn straight<C: Car>(&mut self, car: &C) {
+        let now = car.now_ns();
+        let phase = match self.straight {
+            Some(phase) => phase,
+            None => Straight::Kick {
+                until: now + KICK_NS,
+            },
+        };
+
+        self.straight = Some(match phase {
+            Straight::Kick { until } if now < until => {
+                car.set_direct_speed_left(-100);
+                phase
+            }
+            Straight::Kick { .. } => {
+                car.set_target_and_estimate(0, 100);
+                Straight::Turn {
+                    until: now + TURN_NS,
+                }
+            }
+            Straight::Turn { until } if now < until => {
+                car.set_target_and_estimate(0, 100);
+                phase
+            }
+            Straight::Turn { .. } => Straight::Align { same: 0, next: now },
+            Straight::Align { same, next } => {
+                car.set_target_and_estimate(0, 100);
+                if now < next {
+                    phase
+                } else {
+                    trace(Event::UltBegin, 0);
+                    let state = car.read();
+                    let left_distance = distance_mm(&state.ultrasonic[0]);
+                    let right_distance = distance_mm(&state.ultrasonic[1]);
+                    let aligned = left_distance < 1500
+                        && left_distance > 1250
+                        && right_distance < 1500
+                        && right_distance > 1250;
+                    let same = if aligned { same + 1 } else { 0 };
+                    trace(Event::UltEnd, 0);
+                    if same == 12 {
+                        car.set_target_and_estimate(0, 0);
+                        Straight::Brake {
+                            until: now + BRAKE_NS,
+                        }
+                    } else {
+                        Straight::Align {
+                            same,
+                            next: now + ALIGN_SAMPLE_NS,
+                        }
+                    }
+                }
+            }
+            Straight::Brake { until } if now < until => {
+                car.set_target_and_estimate(0, 0);
+                phase
+            }
+            Straight::Brake { .. } => Straight::CountLines {
+                count: 0,
+                last: false,
+                next: now,
+            },
+            Straight::CountLines { count, last, next } => {
+                let state = car.read();
+                let left_distance = distance_mm(&state.ultrasonic[0]);
+                let right_distance = distance_mm(&state.ultrasonic[1]);
+                if left_distance < 250 || right_distance < 250 {
+                    car.set_direct_speed(0, 0);
+                } else {
+                    car.set_target_and_estimate(300, 300);
+                }
+                if now < next {
+                    phase
+                } else {
+                    trace(Event::LinesBegin, 0);
+                    let new = car.lines().middle_left;
+                    let mut next = now + LINE_SAMPLE_NS;
+                    let mut count = count;
+                    if last != new {
+                        if !new {
+                            count += 1;
+                        }
+                        if count == 8 {
+                            self.set_mode(Mode::Idle);
+                        }
+                        next = now + LINE_HOLDOFF_NS;
+                    }
+                    trace(Event::LinesEnd, 0);
+                    Straight::CountLines {
+                        count,
+                        last: new,
+                        next,
+                    }
+                }
+            }
+        });
+    }
+}
+
+/// Staying and driving in between to line
+fn between_lines<C: Car>(car: &C, fwd: i32, rev: i32, reverse: bool) {
+    let Lines {
+        left,
+        middle_left,
+        middle_right,
+        right,
+    } = car.lines();
+    if left || middle_left {
+        if reverse {
+            car.set_direct_speed(100, -100);
+        } else {
+            car.set_direct_speed(fwd, rev);
+        }
+    } else if right || middle_right {
+        if reverse {
+            car.set_direct_speed(-100, 100);
+        } else {
+            car.set_direct_speed(rev, fwd);
+        }
+    } else {
+        car.set_direct_speed(fwd, fwd);
+    }
+}
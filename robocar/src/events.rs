@@ -0,0 +1,215 @@
+//! Event driven main task
+//!
+//! Instead of sleeping until its next release, the main task waits in one `epoll_wait()`
+//! for the first of
+//! - new data of a sensor device (the drivers wake `poll()` on every event)
+//! - its periodic release from a timerfd, the safety check runs at least once a period
+//! - a `Notifier`, which other threads signal after they switched the mode
+//!
+//! The release accounting of `periodic` still applies to the timer releases. Two jobs
+//! start at least `min_gap` apart, so the main task stays sporadic with `min_gap` as its
+//! minimum interarrival time in the real-time proof.
+
+use crate::periodic::{now_ns, sleep_until, Periodic};
+use std::io::Error;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::time::Duration;
+
+/// epoll data of the timerfd and the eventfd, devices use their index
+const TIMER: u64 = u64::MAX;
+const NOTIFIER: u64 = u64::MAX - 1;
+
+/// Wakes an `EventLoop` from another thread, it is not blocked by it
+pub struct Notifier {
+    fd: RawFd,
+}
+
+impl Notifier {
+    pub fn notify(&self) {
+        let one: u64 = 1;
+        unsafe {
+            libc::write(self.fd, &one as *const u64 as *const libc::c_void, 8);
+        }
+    }
+}
+
+impl AsRawFd for Notifier {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd
+    }
+}
+
+impl Clone for Notifier {
+    fn clone(&self) -> Self {
+        let fd = unsafe { libc::dup(self.fd) };
+        assert!(fd >= 0, "Could not clone notifier: {}", Error::last_os_error());
+        Notifier { fd }
+    }
+}
+
+impl Drop for Notifier {
+    fn drop(&mut self) {
+        unsafe {
+            libc::close(self.fd);
+        }
+    }
+}
+
+/// What ended an `EventLoop::wait()`, several sources can fire at once
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Wakeup {
+    /// Periodic release of the task
+    pub timer: bool,
+    /// A `Notifier` was signalled
+    pub notified: bool,
+    /// Bit n is set when the device with index n from `watch()` has new data
+    pub devices: u32,
+}
+
+impl Wakeup {
+    pub fn device(&self, index: usize) -> bool {
+        self.devices & (1 << index) != 0
+    }
+}
+
+pub struct EventLoop {
+    epoll: RawFd,
+    timer: RawFd,
+    notifier: Notifier,
+    task: Periodic,
+    min_gap: u64,
+    /// The last wakeup was a timer release, its job ends with the next `wait()`
+    released: bool,
+    last_start: u64,
+    devices: usize,
+}
+
+impl EventLoop {
+    /// Takes over the releases of `task`, the first job is the one running now
+    pub fn new(task: Periodic, min_gap: Duration) -> Self {
+        let epoll = unsafe { libc::epoll_create1(libc::EPOLL_CLOEXEC) };
+        assert!(epoll >= 0, "Could not create epoll: {}", Error::last_os_error());
+        let timer = unsafe {
+            libc::timerfd_create(libc::CLOCK_MONOTONIC, libc::TFD_CLOEXEC | libc::TFD_NONBLOCK)
+        };
+        assert!(timer >= 0, "Could not create timerfd: {}", Error::last_os_error());
+        let notifier = unsafe { libc::eventfd(0, libc::EFD_CLOEXEC | libc::EFD_NONBLOCK) };
+        assert!(notifier >= 0, "Could not create eventfd: {}", Error::last_os_error());
+
+        let events = EventLoop {
+            epoll,
+            timer,
+            notifier: Notifier { fd: notifier },
+            task,
+            min_gap: min_gap.as_nanos() as u64,
+            released: true,
+            last_start: now_ns(),
+            devices: 0,
+        };
+        events.add(timer, TIMER, libc::EPOLLIN);
+        events.add(notifier, NOTIFIER, libc::EPOLLIN);
+        events
+    }
+
+    pub fn notifier(&self) -> Notifier {
+        self.notifier.clone()
+    }
+
+    /// Wakes the loop whenever `device` gets new data, returns its index in `Wakeup`.
+    /// Edge triggered: every new event of the driver wakes the loop once, whether the
+    /// data was read or not. Values can come from the snapshot page instead.
+    pub fn watch<D: AsRawFd>(&mut self, device: &D) -> usize {
+        let index = self.devices;
+        assert!(index < 32, "Too many devices in the event loop");
+        self.add(device.as_raw_fd(), index as u64, libc::EPOLLIN | libc::EPOLLET);
+        self.devices += 1;
+        index
+    }
+
+    fn add(&self, fd: RawFd, data: u64, events: i32) {
+        let mut event = libc::epoll_event {
+            events: events as u32,
+            u64: data,
+        };
+        let result = unsafe { libc::epoll_ctl(self.epoll, libc::EPOLL_CTL_ADD, fd, &mut event) };
+        assert!(result == 0, "Could not watch fd {}: {}", fd, Error::last_os_error());
+    }
+
+    /// Ends the current job and sleeps until the next release or until another source fires
+    pub fn wait(&mut self) -> Wakeup {
+        if self.released {
+            let release = self.task.end_job();
+            self.arm(release);
+            self.released = false;
+        }
+        sleep_until(self.last_start + self.min_gap);
+
+        let mut events = [libc::epoll_event { events: 0, u64: 0 }; 8];
+        let count = loop {
+            let count =
+                unsafe { libc::epoll_wait(self.epoll, events.as_mut_ptr(), events.len() as i32, -1) };
+            if count >= 0 {
+                break count as usize;
+            }
+            let error = Error::last_os_error();
+            if error.raw_os_error() != Some(libc::EINTR) {
+                panic!("epoll_wait failed: {}", error);
+            }
+        };
+        self.last_start = now_ns();
+
+        let mut wakeup = Wakeup::default();
+        for event in &events[..count] {
+            match event.u64 {
+                TIMER => {
+                    Self::clear(self.timer);
+                    self.task.start_job();
+                    self.released = true;
+                    wakeup.timer = true;
+                }
+                NOTIFIER => {
+                    Self::clear(self.notifier.fd);
+                    wakeup.notified = true;
+                }
+                index => wakeup.devices |= 1 << index,
+            }
+        }
+        wakeup
+    }
+
+    /// One shot at `release` ns on CLOCK_MONOTONIC
+    fn arm(&self, release: u64) {
+        let zero = libc::timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        };
+        let spec = libc::itimerspec {
+            it_interval: zero,
+            it_value: libc::timespec {
+                tv_sec: (release / 1_000_000_000) as libc::time_t,
+                tv_nsec: (release % 1_000_000_000) as libc::c_long,
+            },
+        };
+        let result = unsafe {
+            libc::timerfd_settime(self.timer, libc::TFD_TIMER_ABSTIME, &spec, std::ptr::null_mut())
+        };
+        assert!(result == 0, "Could not arm timerfd: {}", Error::last_os_error());
+    }
+
+    /// Reads the counter of a timerfd or eventfd, so it no longer reports readable
+    fn clear(fd: RawFd) {
+        let mut count: u64 = 0;
+        unsafe {
+            libc::read(fd, &mut count as *mut u64 as *mut libc::c_void, 8);
+        }
+    }
+}
+
+impl Drop for EventLoop {
+    fn drop(&mut self) {
+        unsafe {
+            libc::close(self.timer);
+            libc::close(self.epoll);
+        }
+    }
+}
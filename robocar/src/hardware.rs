@@ -1,164 +1,298 @@
-use crate::logging::*;
-use linux_embedded_hal::spidev::SpidevOptions;
-use linux_embedded_hal::sysfs_gpio::Direction;
-use linux_embedded_hal::{Pin, Spidev};
-use mfrc522::Mfrc522;
+use nix::ioctl_write_ptr;
+use robocar::car::{Car, CarState, Card, Lines, Sample, Wheel};
+use robocar::odometry::{Estimate, Odometry, SharedEstimate};
+use robocar::periodic::{self, now_ns};
 use std::fs::File;
 use std::fs::OpenOptions;
 use std::io::Read;
 use std::io::Write;
-use std::mem::transmute;
-use std::sync::atomic::{AtomicBool, AtomicI32, Ordering};
+use std::marker::PhantomData;
+use std::mem::size_of;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::sync::atomic::{fence, AtomicI32, AtomicU32, Ordering};
 use std::sync::Arc;
-use std::{thread, time};
+use std::thread;
 
-pub struct MotorProperties {
-    target_mm_per_s: AtomicI32,
-    current_percentage: AtomicI32,
-}
+// _IOW('m', 3/5, struct motor_pair) from drivers/motor/motor.h
+ioctl_write_ptr!(motor_set_pair_target, b'm', 3, MotorValues);
+ioctl_write_ptr!(motor_set_pair_duty, b'm', 5, MotorValues);
 
-impl MotorProperties {
-    fn get_target(&self) -> i32 {
-        self.target_mm_per_s.load(Ordering::SeqCst)
-    }
+/// `MOTOR_DUTY_MAX` from drivers/motor/motor.h, duty cycles are in permille
+pub const DUTY_MAX: i32 = 1000;
 
-    fn set_target(&self, new_target: i32) {
-        self.target_mm_per_s.store(new_target, Ordering::SeqCst);
-    }
-
-    fn get_current(&self) -> i32 {
-        self.current_percentage.load(Ordering::SeqCst)
-    }
-
-    fn set_current(&self, new_percentage: i32) {
-        self.current_percentage
-            .store(new_percentage, Ordering::SeqCst);
-    }
+/// Layout of `struct motor_pair`
+#[repr(C)]
+struct MotorValues {
+    left: i32,
+    right: i32,
 }
 
+/// Marks that the motor is driven directly and not by the kernel speed controller
+const NO_SPEED_TARGET: i32 = std::i32::MIN;
+
 pub struct Motor {
     device: File,
-    description: String,
-    prev_speed: Arc<AtomicI32>,
-    speed_control_activated: Arc<AtomicBool>,
-    properties: Arc<MotorProperties>,
+    prev_speed: AtomicI32,
 }
 
 impl Motor {
-    pub fn set_target_and_estimate(&self, new_speed: i32) {
-        self.set_speed_control(true);
-        if new_speed != self.prev_speed.load(Ordering::SeqCst) {
-            self.properties.set_target(new_speed);
-            let new_power = if new_speed == 0 {
-                0
-            } else {
-                (new_speed / 10) + 50 * new_speed.signum()
-            };
-            self.properties.set_current(new_power);
-            Motor::set_speed(&self.device, new_power);
-            self.prev_speed.store(new_speed, Ordering::SeqCst);
-        }
-    }
-
-    pub fn new(dev: &str, lightbarrier: Device, description: &str) -> Self {
-        let mut motor = Motor {
+    pub fn new(dev: &str) -> Self {
+        Motor {
             device: OpenOptions::new()
                 .write(true)
                 .open(dev)
                 .expect(&format!("Could not open {}", dev)),
-            description: String::from(description),
-            speed_control_activated: Arc::new(AtomicBool::new(false)),
-            prev_speed: Arc::new(AtomicI32::new(0)),
-            properties: Arc::new(MotorProperties {
-                current_percentage: AtomicI32::new(0),
-                target_mm_per_s: AtomicI32::new(0),
-            }),
-        };
-        motor.start_speed_control(lightbarrier);
-        motor
-    }
-
-    pub fn set_speed_control(&self, activated: bool) {
-        self.speed_control_activated
-            .store(activated, Ordering::SeqCst);
-    }
-
-    pub fn start_speed_control(&mut self, mut lightbarrier: Device) -> thread::JoinHandle<()> {
-        let props = self.properties.clone();
-        let sc_activated = self.speed_control_activated.clone();
-        let file = self.device.try_clone().unwrap();
-        let description = self.description.clone();
-
-        thread::spawn(move || {
-            thread::sleep(time::Duration::from_millis(100));
-            let mut last_lightbarrier_ticks = 0;
-            loop {
-                let activated = sc_activated.load(Ordering::SeqCst);
-                if activated {
-                    log_with_time(&format!("1|{}", description));
-                    // 1 light barrier break means 1.125 cm.
-                    let speed_target = ((props.get_target() as f32 / 9.0) / 10.0) as i32;
-
-                    let lightbarrier_current_ticks = lightbarrier.read();
-                    let lightbarrier_relative_ticks =
-                        lightbarrier_current_ticks - last_lightbarrier_ticks;
-                    last_lightbarrier_ticks = lightbarrier_current_ticks;
-
-                    let lightbarrier_speed = lightbarrier_relative_ticks * speed_target.signum();
-
-                    let new_speed = if lightbarrier_speed > speed_target
-                        && props.get_current() - 2 > -100
-                    {
-                        props.get_current() - 2
-                    } else if lightbarrier_speed < speed_target && props.get_current() + 2 < 100 {
-                        props.get_current() + 2
-                    } else {
-                        props.get_current()
-                    };
-
-                    props.set_current(new_speed);
-                    Motor::set_speed(&file, new_speed);
-                    log_with_time(&format!("2|{}", description));
-                    thread::sleep(time::Duration::from_millis(100));
-                    continue;
-                }
-                thread::sleep(time::Duration::from_millis(10));
-            }
-        })
+            prev_speed: AtomicI32::new(NO_SPEED_TARGET),
+        }
     }
 
     pub fn set_direct_speed(&self, speed: i32) {
-        self.set_speed_control(false);
-        self.properties.set_target(0);
-        self.properties.set_current(0);
-        self.prev_speed.store(0, Ordering::SeqCst);
+        self.prev_speed.store(NO_SPEED_TARGET, Ordering::SeqCst);
         Motor::set_speed(&self.device, speed);
     }
 
     fn set_speed(mut device: &File, speed: i32) {
-        let bytes: [u8; 4] = unsafe { transmute(speed) };
+        let bytes = speed.to_ne_bytes();
         device
             .write_all(&bytes)
             .expect(&format!("Could not write to {:?} motor", device));
     }
 }
 
-pub struct Rfid {}
+/// Sign of the last nonzero command to each motor. The lightbarriers cannot tell the
+/// direction of a tick, the odometry takes it from here.
+pub struct Directions([AtomicI32; 2]);
+
+impl Directions {
+    fn new() -> Self {
+        Directions([AtomicI32::new(1), AtomicI32::new(1)])
+    }
+
+    fn set(&self, index: usize, speed: i32) {
+        if speed != 0 {
+            self.0[index].store(speed.signum(), Ordering::Relaxed);
+        }
+    }
+
+    pub fn get(&self) -> [i32; 2] {
+        [self.0[0].load(Ordering::Relaxed), self.0[1].load(Ordering::Relaxed)]
+    }
+}
+
+/// Both motors, commands for the pair reach the kernel module in one syscall
+/// and are applied to both wheels at once
+pub struct MotorPair {
+    pub left: Motor,
+    pub right: Motor,
+    pub directions: Arc<Directions>,
+}
+
+impl MotorPair {
+    pub fn new(left: &str, right: &str) -> Self {
+        MotorPair {
+            left: Motor::new(left),
+            right: Motor::new(right),
+            directions: Arc::new(Directions::new()),
+        }
+    }
+
+    /// Speed targets in mm/s for the kernel speed controller
+    pub fn set_target_and_estimate(&self, left: i32, right: i32) {
+        if left != self.left.prev_speed.load(Ordering::SeqCst)
+            || right != self.right.prev_speed.load(Ordering::SeqCst)
+        {
+            let values = MotorValues { left, right };
+            unsafe { motor_set_pair_target(self.left.device.as_raw_fd(), &values) }
+                .expect("Could not set speed targets of the motors");
+            self.left.prev_speed.store(left, Ordering::SeqCst);
+            self.right.prev_speed.store(right, Ordering::SeqCst);
+            self.directions.set(0, left);
+            self.directions.set(1, right);
+        }
+    }
+
+    /// Direct PWM values in %
+    pub fn set_direct_speed(&self, left: i32, right: i32) {
+        self.set_direct_duty(left * DUTY_MAX / 100, right * DUTY_MAX / 100);
+    }
+
+    /// Direct duty cycles in permille, limited to `DUTY_MAX` as the driver rejects more
+    pub fn set_direct_duty(&self, left: i32, right: i32) {
+        let left = left.max(-DUTY_MAX).min(DUTY_MAX);
+        let right = right.max(-DUTY_MAX).min(DUTY_MAX);
+        self.left.prev_speed.store(NO_SPEED_TARGET, Ordering::SeqCst);
+        self.right.prev_speed.store(NO_SPEED_TARGET, Ordering::SeqCst);
+        let values = MotorValues { left, right };
+        unsafe { motor_set_pair_duty(self.left.device.as_raw_fd(), &values) }
+            .expect("Could not set duty cycles of the motors");
+        self.directions.set(0, left);
+        self.directions.set(1, right);
+    }
+
+    pub fn set_direct_speed_left(&self, speed: i32) {
+        self.left.set_direct_speed(speed);
+        self.directions.set(0, speed);
+    }
+}
+
+/// MFRC522 reader of the rfid kernel module, it searches for cards on its own
+pub struct Rfid {
+    device: File,
+}
 
 impl Rfid {
-    pub fn new(pin_number: u64) -> Mfrc522<Spidev, Pin> {
-        let mut spi = Spidev::open("/dev/spidev0.0").unwrap();
-        let options = SpidevOptions::new()
-            .max_speed_hz(1_000_000)
-            .mode(linux_embedded_hal::spidev::SPI_MODE_0)
-            .build();
-        spi.configure(&options).unwrap();
-        let pin = Pin::new(pin_number);
-        pin.export().unwrap();
-        while !pin.is_exported() {}
-        pin.set_direction(Direction::Out).unwrap();
-        pin.set_value(1).unwrap();
-        Mfrc522::new(spi, pin).unwrap()
+    pub fn new(dev: &str) -> Self {
+        Rfid {
+            device: File::open(dev).expect(&format!("Could not open {}", dev)),
+        }
+    }
+
+    /// Blocks until a new card enters the field. A card that stays reports only once.
+    pub fn wait_for_card(&mut self) -> Card {
+        let mut card = Card::default();
+        let buffer = unsafe {
+            std::slice::from_raw_parts_mut(&mut card as *mut Card as *mut u8, size_of::<Card>())
+        };
+        self.device
+            .read_exact(buffer)
+            .expect(&format!("Could not read from {:?}", self.device));
+        card
+    }
+}
+
+/// Counter state of a lightbarrier with the timing of its recent edges
+#[repr(C)]
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Ticks {
+    pub ticks: i32,
+    /// Filtered wheel speed in mm/s, decays when no edges arrive
+    pub velocity_mm_per_s: u32,
+    pub last_tick_ns: u64,
+    /// Time between the recent edges, newest first, 0 when unknown
+    pub periods_ns: [u32; 8],
+    /// From the hard interrupt of the last edge to the threaded handler
+    pub handler_delay_ns: u32,
+    reserved: u32,
+}
+
+/// A press of the emergency button, `struct emergency_event` from drivers/emergency/emergency.h
+#[repr(C)]
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Press {
+    /// Edge of the button in the hard interrupt
+    pub timestamp_ns: u64,
+    /// Presses since the module was loaded
+    pub presses: u32,
+    pub handler_delay_ns: u32,
+}
+
+/// State of the IR line sensors, `struct linesensor_state` from drivers/linesensor/linesensor.h
+#[repr(C)]
+#[derive(Clone, Copy, Default, Debug)]
+pub struct LineState {
+    /// Bit set while the sensor sees a line, see `Lines::from_mask`
+    pub mask: u32,
+    /// Counts the edges of all sensors
+    pub sequence: u32,
+    /// Last edge of every sensor in the hard interrupt, 0 when none yet
+    pub changed_ns: [u64; 4],
+}
+
+/// Page a kernel module publishes its latest values in, mapped read-only.
+/// The page starts with a sequence counter and the size of the data that follows.
+pub struct Snapshot<T: Copy> {
+    page: *const u8,
+    _marker: PhantomData<T>,
+}
+
+const SNAPSHOT_PAGE_SIZE: usize = 4096;
+const SNAPSHOT_HEADER_SIZE: usize = 8;
+
+unsafe impl<T: Copy> Send for Snapshot<T> {}
+
+impl<T: Copy> Snapshot<T> {
+    fn map(device: &File) -> Self {
+        let page = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                SNAPSHOT_PAGE_SIZE,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                device.as_raw_fd(),
+                0,
+            )
+        };
+        if page == libc::MAP_FAILED {
+            panic!("Could not map snapshot of {:?}", device);
+        }
+        let size = unsafe { *(page as *const u32).offset(1) } as usize;
+        assert_eq!(size, size_of::<T>(), "Snapshot layout of {:?} differs", device);
+        Snapshot {
+            page: page as *const u8,
+            _marker: PhantomData,
+        }
+    }
+
+    /// Consistent copy of the data, retries while the driver writes it. No syscall involved.
+    pub fn read(&self) -> T {
+        let sequence = unsafe { &*(self.page as *const AtomicU32) };
+        loop {
+            let before = sequence.load(Ordering::Acquire);
+            if before & 1 != 0 {
+                std::hint::spin_loop();
+                continue;
+            }
+            let value =
+                unsafe { std::ptr::read_volatile(self.page.add(SNAPSHOT_HEADER_SIZE) as *const T) };
+            fence(Ordering::Acquire);
+            if sequence.load(Ordering::Relaxed) == before {
+                return value;
+            }
+        }
+    }
+}
+
+impl<T: Copy> Drop for Snapshot<T> {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.page as *mut libc::c_void, SNAPSHOT_PAGE_SIZE);
+        }
+    }
+}
+
+/// `ULTRASONIC_MAX_SENSORS` from drivers/ultrasonic/ultrasonic.c, the snapshot page holds
+/// the latest sample of every sensor at its device tree `index`
+const ULTRASONIC_SENSORS: usize = 8;
+
+/// Snapshot pages of the ultrasonic, lightbarrier and linesensor modules,
+/// index 0 is left, 1 is right
+pub struct Sensors {
+    ultrasonic: Snapshot<[Sample; ULTRASONIC_SENSORS]>,
+    wheels: Snapshot<[Wheel; 2]>,
+    lines: Snapshot<LineState>,
+}
+
+impl Sensors {
+    pub fn new(ultrasonic: &Device, lightbarrier: &Device, linesensor: &Device) -> Self {
+        Sensors {
+            ultrasonic: ultrasonic.snapshot(),
+            wheels: lightbarrier.snapshot(),
+            lines: linesensor.snapshot(),
+        }
+    }
+
+    pub fn lines(&self) -> Lines {
+        Lines::from_mask(self.lines.read().mask)
+    }
+
+    pub fn read(&self) -> CarState {
+        CarState {
+            ultrasonic: {
+                let latest = self.ultrasonic.read();
+                [latest[0], latest[1]]
+            },
+            wheels: self.wheels.read(),
+        }
     }
 }
 
@@ -177,10 +311,87 @@ impl Device {
         }
     }
 
-    pub fn read(&mut self) -> i32 {
-        let mut buf = [0; 4];
-        self.device.read(&mut buf).unwrap();
-        return unsafe { std::mem::transmute::<[u8; 4], i32>(buf) }.to_le();
+    /// Reads the tick count together with the edge timing from a lightbarrier
+    pub fn read_ticks(&mut self) -> Ticks {
+        let mut ticks = Ticks::default();
+        let bytes = unsafe {
+            std::slice::from_raw_parts_mut(&mut ticks as *mut Ticks as *mut u8, size_of::<Ticks>())
+        };
+        self.device.read(bytes).unwrap();
+        ticks
+    }
+
+    /// Blocks until the emergency button is pressed. The kernel has already stopped
+    /// the motors then and keeps them stopped until `release_stop()`.
+    pub fn read_press(&mut self) -> Press {
+        self.read_record()
+    }
+
+    /// Reads one record as the driver hands it out, e.g. a `Press` or a `LineState`
+    pub fn read_record<T: Copy + Default>(&mut self) -> T {
+        let mut record = T::default();
+        let bytes = unsafe {
+            std::slice::from_raw_parts_mut(&mut record as *mut T as *mut u8, size_of::<T>())
+        };
+        self.device
+            .read_exact(bytes)
+            .expect(&format!("Could not read from {:?}", self.device));
+        record
+    }
+
+    /// Lets the motors take commands again after the emergency button was pressed
+    pub fn release_stop(&mut self) {
+        self.device
+            .write_all(&[0])
+            .expect(&format!("Could not release the emergency stop of {:?}", self.device));
+    }
+
+    /// Maps the snapshot page the kernel module publishes its latest values in
+    pub fn snapshot<T: Copy>(&self) -> Snapshot<T> {
+        Snapshot::map(&self.device)
+    }
+
+    /// Drains all queued samples that fit into `samples` with a single syscall.
+    /// Blocks until at least one sample is available, unless the device is
+    /// `set_nonblocking()`, then it returns 0 for an empty queue.
+    pub fn read_samples(&mut self, samples: &mut [Sample]) -> usize {
+        let bytes = unsafe {
+            std::slice::from_raw_parts_mut(
+                samples.as_mut_ptr() as *mut u8,
+                samples.len() * size_of::<Sample>(),
+            )
+        };
+        match self.device.read(bytes) {
+            Ok(read) => read / size_of::<Sample>(),
+            Err(ref error) if error.kind() == std::io::ErrorKind::WouldBlock => 0,
+            Err(error) => panic!("Could not read samples of {:?}: {}", self.device, error),
+        }
+    }
+
+    /// Empties the queue of a nonblocking device, returns the number of samples read
+    pub fn drain_samples(&mut self, samples: &mut [Sample]) -> usize {
+        let mut total = 0;
+        loop {
+            let count = self.read_samples(samples);
+            total += count;
+            if count < samples.len() {
+                return total;
+            }
+        }
+    }
+
+    /// Reads return at once instead of waiting for new data
+    pub fn set_nonblocking(&self) {
+        unsafe {
+            let flags = libc::fcntl(self.device.as_raw_fd(), libc::F_GETFL);
+            libc::fcntl(self.device.as_raw_fd(), libc::F_SETFL, flags | libc::O_NONBLOCK);
+        }
+    }
+}
+
+impl AsRawFd for Device {
+    fn as_raw_fd(&self) -> RawFd {
+        self.device.as_raw_fd()
     }
 }
 
@@ -191,3 +402,88 @@ impl Clone for Device {
         }
     }
 }
+
+/// The real car: kernel modules for motors and sensors
+pub struct Robot {
+    pub motors: MotorPair,
+    sensors: Sensors,
+    odometry: Arc<SharedEstimate>,
+}
+
+impl Robot {
+    pub fn new(motors: MotorPair, sensors: Sensors) -> Self {
+        Robot {
+            motors,
+            sensors,
+            odometry: Arc::new(SharedEstimate::new()),
+        }
+    }
+
+    /// Integrates every tick of the lightbarriers in a thread of its own. The main loop
+    /// only reads the latest estimate and never waits for it.
+    pub fn start_odometry(&self, mut lightbarriers: [Device; 2]) {
+        let wheels: Snapshot<[Wheel; 2]> = lightbarriers[0].snapshot();
+        let directions = self.motors.directions.clone();
+        let shared = self.odometry.clone();
+        thread::spawn(move || {
+            // Woken by every wheel tick, must not run at the priority of the main loop
+            periodic::setup_background(0);
+            let mut odometry = Odometry::new();
+            shared.publish(odometry.update(&wheels.read(), directions.get()));
+            loop {
+                let mut fds = [
+                    libc::pollfd {
+                        fd: lightbarriers[0].as_raw_fd(),
+                        events: libc::POLLIN,
+                        revents: 0,
+                    },
+                    libc::pollfd {
+                        fd: lightbarriers[1].as_raw_fd(),
+                        events: libc::POLLIN,
+                        revents: 0,
+                    },
+                ];
+                // The timeout only keeps the velocity current while the wheels stand still
+                if unsafe { libc::poll(fds.as_mut_ptr(), 2, 100) } < 0 {
+                    continue;
+                }
+                for (fd, lightbarrier) in fds.iter().zip(lightbarriers.iter_mut()) {
+                    if fd.revents & libc::POLLIN != 0 {
+                        lightbarrier.read_ticks();
+                    }
+                }
+                shared.publish(odometry.update(&wheels.read(), directions.get()));
+            }
+        });
+    }
+}
+
+impl Car for Robot {
+    fn read(&self) -> CarState {
+        self.sensors.read()
+    }
+
+    fn lines(&self) -> Lines {
+        self.sensors.lines()
+    }
+
+    fn set_direct_speed(&self, left: i32, right: i32) {
+        self.motors.set_direct_speed(left, right);
+    }
+
+    fn odometry(&self) -> Estimate {
+        self.odometry.read()
+    }
+
+    fn set_direct_speed_left(&self, speed: i32) {
+        self.motors.set_direct_speed_left(speed);
+    }
+
+    fn set_target_and_estimate(&self, left: i32, right: i32) {
+        self.motors.set_target_and_estimate(left, right);
+    }
+
+    fn now_ns(&self) -> u64 {
+        now_ns()
+    }
+}
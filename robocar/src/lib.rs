@@ -0,0 +1,11 @@
+//! Code shared by the robocar program and the tools that run on the host
+
+pub mod analysis;
+pub mod car;
+pub mod controller;
+pub mod events;
+pub mod logging;
+pub mod mode;
+pub mod odometry;
+pub mod periodic;
+pub mod sim;
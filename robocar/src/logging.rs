@@ -1,29 +1,269 @@
+use crate::mode::Mode;
+use crate::periodic::now_ns;
 use log::*;
 use simplelog::*;
+use std::cell::UnsafeCell;
 use std::fs::File;
+use std::io::{BufWriter, Read, Write};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::{thread, time};
 
+/// Binary trace written by the flusher thread, `decode_trace` turns it into the old text log
+pub const TRACE_FILE: &str = "/tmp/timing.trace";
+
+/// Markers of the timing log. The number in front of `|` orders the markers of one task.
+#[repr(u32)]
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub enum Event {
+    RfidBegin,
+    RfidEnd,
+    SleepBegin,
+    SleepEnd,
+    MainBegin,
+    /// Payload is the mode the iteration ran in
+    ModeEnd,
+    MainEnd,
+    UltBegin,
+    UltEnd,
+    LinesBegin,
+    LinesEnd,
+    EmergencyButton,
+}
+
+const EVENTS: [Event; 12] = [
+    Event::RfidBegin,
+    Event::RfidEnd,
+    Event::SleepBegin,
+    Event::SleepEnd,
+    Event::MainBegin,
+    Event::ModeEnd,
+    Event::MainEnd,
+    Event::UltBegin,
+    Event::UltEnd,
+    Event::LinesBegin,
+    Event::LinesEnd,
+    Event::EmergencyButton,
+];
+
+impl Event {
+    pub fn from_id(id: u32) -> Option<Event> {
+        EVENTS.get(id as usize).cloned()
+    }
+
+    /// Message as it appeared in `/tmp/timing.log`
+    pub fn message(self, payload: u32) -> String {
+        match self {
+            Event::RfidBegin => "0|RFID".to_string(),
+            Event::RfidEnd => "1|RFID".to_string(),
+            Event::SleepBegin => "0|SLEEP".to_string(),
+            Event::SleepEnd => "1|SLEEP".to_string(),
+            Event::MainBegin => "1|MAIN".to_string(),
+            Event::ModeEnd => match Mode::from_index(payload as usize) {
+                Some(mode) => format!("3|{}", mode),
+                None => format!("3|{}", payload),
+            },
+            Event::MainEnd => "4|END".to_string(),
+            Event::UltBegin => "1|ULT".to_string(),
+            Event::UltEnd => "2|ULT".to_string(),
+            Event::LinesBegin => "1|LINES".to_string(),
+            Event::LinesEnd => "2|LINES".to_string(),
+            Event::EmergencyButton => "Emergency Button pressed".to_string(),
+        }
+    }
+}
+
+/// One entry of the binary trace, stored little endian in `TRACE_FILE`
+#[derive(Clone, Copy, Default, Debug)]
+pub struct Record {
+    /// CLOCK_MONOTONIC
+    pub timestamp_ns: u64,
+    pub event: u32,
+    pub payload: u32,
+}
+
+pub const RECORD_SIZE: usize = 16;
+
+impl Record {
+    pub fn to_bytes(&self) -> [u8; RECORD_SIZE] {
+        let mut bytes = [0; RECORD_SIZE];
+        bytes[0..8].copy_from_slice(&self.timestamp_ns.to_le_bytes());
+        bytes[8..12].copy_from_slice(&self.event.to_le_bytes());
+        bytes[12..16].copy_from_slice(&self.payload.to_le_bytes());
+        bytes
+    }
+
+    pub fn from_bytes(bytes: &[u8; RECORD_SIZE]) -> Self {
+        let mut timestamp = [0; 8];
+        let mut event = [0; 4];
+        let mut payload = [0; 4];
+        timestamp.copy_from_slice(&bytes[0..8]);
+        event.copy_from_slice(&bytes[8..12]);
+        payload.copy_from_slice(&bytes[12..16]);
+        Record {
+            timestamp_ns: u64::from_le_bytes(timestamp),
+            event: u32::from_le_bytes(event),
+            payload: u32::from_le_bytes(payload),
+        }
+    }
+
+    /// Line of the old `/tmp/timing.log`, `None` for an unknown event id
+    pub fn to_line(&self) -> Option<String> {
+        let event = Event::from_id(self.event)?;
+        Some(format!(
+            "{},{}|{}",
+            self.timestamp_ns / 1_000_000_000,
+            self.timestamp_ns % 1_000_000_000 / 1000,
+            event.message(self.payload)
+        ))
+    }
+}
+
+/// Reads all records of a trace file, a truncated last record is ignored
+pub fn read_records<R: Read>(reader: R, mut each: impl FnMut(Record)) -> std::io::Result<()> {
+    let mut reader = std::io::BufReader::new(reader);
+    let mut bytes = [0; RECORD_SIZE];
+    loop {
+        match reader.read_exact(&mut bytes) {
+            Ok(()) => each(Record::from_bytes(&bytes)),
+            Err(ref e) if e.kind() == std::io::ErrorKind::UnexpectedEof => return Ok(()),
+            Err(e) => return Err(e),
+        }
+    }
+}
+
+const RING_SIZE: usize = 1024;
+const FLUSH_INTERVAL: time::Duration = time::Duration::from_millis(100);
+
+/// Single producer (the traced thread), single consumer (the flusher) ring
+struct Ring {
+    records: Box<[UnsafeCell<Record>]>,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    dropped: AtomicUsize,
+}
+
+unsafe impl Sync for Ring {}
+unsafe impl Send for Ring {}
+
+impl Ring {
+    fn new() -> Self {
+        Ring {
+            records: (0..RING_SIZE).map(|_| UnsafeCell::new(Record::default())).collect(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            dropped: AtomicUsize::new(0),
+        }
+    }
+
+    /// Only called by the owning thread. Drops the record if the flusher fell behind.
+    fn push(&self, record: Record) {
+        let head = self.head.load(Ordering::Relaxed);
+        if head.wrapping_sub(self.tail.load(Ordering::Acquire)) == RING_SIZE {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+        unsafe {
+            *self.records[head % RING_SIZE].get() = record;
+        }
+        self.head.store(head.wrapping_add(1), Ordering::Release);
+    }
+
+    /// Only called by the flusher
+    fn drain(&self, out: &mut Vec<Record>) {
+        let mut tail = self.tail.load(Ordering::Relaxed);
+        let head = self.head.load(Ordering::Acquire);
+        while tail != head {
+            out.push(unsafe { *self.records[tail % RING_SIZE].get() });
+            tail = tail.wrapping_add(1);
+        }
+        self.tail.store(tail, Ordering::Release);
+    }
+}
+
+static RINGS: Mutex<Vec<Arc<Ring>>> = Mutex::new(Vec::new());
+static WRITER: Mutex<Option<BufWriter<File>>> = Mutex::new(None);
+static REPORTED_DROPPED: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    static RING: Arc<Ring> = {
+        let ring = Arc::new(Ring::new());
+        RINGS.lock().unwrap().push(ring.clone());
+        ring
+    };
+}
+
+fn record(event: Event, payload: u32) -> Record {
+    Record {
+        timestamp_ns: now_ns(),
+        event: event as u32,
+        payload,
+    }
+}
+
+/// Error log plus the flusher thread that writes the trace rings to `TRACE_FILE`
 pub fn start_logging() {
     let mut c = Config::default();
     c.time = None;
     c.level = None;
-    CombinedLogger::init(vec![
-        WriteLogger::new(LevelFilter::Error, c, File::create("error.log").unwrap()),
-        WriteLogger::new(
-            LevelFilter::Info,
-            c,
-            File::create("/tmp/timing.log").unwrap(),
-        ),
-    ])
+    CombinedLogger::init(vec![WriteLogger::new(
+        LevelFilter::Error,
+        c,
+        File::create("error.log").unwrap(),
+    )])
     .unwrap();
+
+    *WRITER.lock().unwrap() = Some(BufWriter::new(File::create(TRACE_FILE).unwrap()));
+    thread::spawn(|| {
+        setup_flusher();
+        loop {
+            thread::sleep(FLUSH_INTERVAL);
+            flush_logging();
+        }
+    });
 }
 
-pub fn log_with_time(message: &str) {
-    let mut timeval = libc::timeval {
-        tv_sec: 0,
-        tv_usec: 0,
-    };
+/// The flusher runs with normal priority on the last core, away from the real-time threads
+fn setup_flusher() {
     unsafe {
-        libc::gettimeofday(&mut timeval, std::ptr::null_mut());
+        let params = libc::sched_param { sched_priority: 0 };
+        let _ = libc::sched_setscheduler(0, libc::SCHED_OTHER, &params);
+        let cpus = libc::sysconf(libc::_SC_NPROCESSORS_ONLN);
+        if cpus > 1 {
+            let mut set: libc::cpu_set_t = std::mem::zeroed();
+            libc::CPU_SET(cpus as usize - 1, &mut set);
+            libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set);
+        }
+    }
+}
+
+/// Writes the records of all rings to `TRACE_FILE` in time order.
+/// Called by the flusher and once more before the program exits.
+pub fn flush_logging() {
+    let mut writer = WRITER.lock().unwrap();
+    let file = match writer.as_mut() {
+        Some(file) => file,
+        None => return,
+    };
+    let mut records = Vec::new();
+    let mut dropped = 0;
+    for ring in RINGS.lock().unwrap().iter() {
+        ring.drain(&mut records);
+        dropped += ring.dropped.load(Ordering::Relaxed);
+    }
+    records.sort_by_key(|r| r.timestamp_ns);
+    for r in &records {
+        let _ = file.write_all(&r.to_bytes());
     }
-    info!("{},{}|{}", timeval.tv_sec, timeval.tv_usec, message);
+    let _ = file.flush();
+    if dropped > REPORTED_DROPPED.swap(dropped, Ordering::Relaxed) {
+        error!("Trace rings full, {} records dropped", dropped);
+    }
+}
+
+/// Records an event of the calling thread. The first call of a thread allocates its ring
+/// and registers it under a lock, after that no syscall, allocation or I/O is involved.
+pub fn trace(event: Event, payload: u32) {
+    let record = record(event, payload);
+    RING.with(|ring| ring.push(record));
 }
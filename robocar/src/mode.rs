@@ -0,0 +1,41 @@
+use std::fmt::*;
+
+#[derive(Clone, Copy, PartialEq, Debug)]
+pub enum Mode {
+    Idle,
+    WallFollowing,
+    LineFollowing,
+    BetweenLines,
+    Straight,
+    EndOfRamp,
+    TopOfRamp,
+}
+
+const MODES: [Mode; 7] = [
+    Mode::Idle,
+    Mode::WallFollowing,
+    Mode::LineFollowing,
+    Mode::BetweenLines,
+    Mode::Straight,
+    Mode::EndOfRamp,
+    Mode::TopOfRamp,
+];
+
+impl Mode {
+    /// `None` for a value that is no mode, e.g. from a damaged trace
+    pub fn from_index(val: usize) -> Option<Mode> {
+        MODES.get(val).cloned()
+    }
+}
+
+impl From<usize> for Mode {
+    fn from(val: usize) -> Self {
+        Mode::from_index(val).unwrap()
+    }
+}
+
+impl Display for Mode {
+    fn fmt(&self, f: &mut Formatter) -> std::fmt::Result {
+        write!(f, "{:?}", self)
+    }
+}
@@ -0,0 +1,133 @@
+//! Dead reckoning from the lightbarrier ticks
+//!
+//! The lightbarriers count the slots of the encoder discs without a direction, the sign
+//! of every new tick is the one of the last command to that motor. The difference of the
+//! two wheels turns the car around the middle of the axle. Coordinates are in mm relative
+//! to where the odometry started, x points forward at heading 0, y to the left, angles in
+//! radians counterclockwise.
+
+use crate::car::Wheel;
+use std::cell::UnsafeCell;
+use std::f64::consts::PI;
+use std::sync::atomic::{fence, AtomicU32, Ordering};
+
+/// `LIGHTBARRIER_UM_PER_TICK` of drivers/lightbarrier/lightbarrier.h
+pub const MM_PER_TICK: f64 = 11.25;
+/// Distance between the wheels
+pub const WHEEL_BASE_MM: f64 = 130.0;
+
+#[derive(Clone, Copy, Default, Debug, PartialEq)]
+pub struct Estimate {
+    pub x_mm: f64,
+    pub y_mm: f64,
+    /// In -π..π
+    pub heading: f64,
+    /// Path of the middle of the axle, forwards and backwards add up
+    pub travelled_mm: f64,
+    /// Speed of the middle of the axle, negative backwards
+    pub velocity_mm_per_s: f64,
+    /// Turn rate in rad/s, counterclockwise positive
+    pub yaw_rate: f64,
+    /// Newest tick that went into the estimate, 0 before the first one
+    pub timestamp_ns: u64,
+}
+
+pub struct Odometry {
+    estimate: Estimate,
+    ticks: Option<[i32; 2]>,
+}
+
+impl Odometry {
+    pub fn new() -> Self {
+        Odometry {
+            estimate: Estimate::default(),
+            ticks: None,
+        }
+    }
+
+    pub fn estimate(&self) -> Estimate {
+        self.estimate
+    }
+
+    /// Adds the ticks since the last update. `directions` are the signs of the last
+    /// nonzero commands to the left and right motor. The first update only takes the
+    /// tick counts as the starting point.
+    pub fn update(&mut self, wheels: &[Wheel; 2], directions: [i32; 2]) -> Estimate {
+        let sign = |i: usize| if directions[i] < 0 { -1.0 } else { 1.0 };
+        let previous = self.ticks.unwrap_or([wheels[0].ticks, wheels[1].ticks]);
+        self.ticks = Some([wheels[0].ticks, wheels[1].ticks]);
+
+        let moved = |i: usize| {
+            wheels[i].ticks.wrapping_sub(previous[i]).max(0) as f64 * MM_PER_TICK * sign(i)
+        };
+        let (left, right) = (moved(0), moved(1));
+        let forward = (left + right) / 2.0;
+        let turn = (right - left) / WHEEL_BASE_MM;
+
+        let estimate = &mut self.estimate;
+        // Along the mean heading of the movement, exact for arcs up to a small error
+        let heading = estimate.heading + turn / 2.0;
+        estimate.x_mm += forward * heading.cos();
+        estimate.y_mm += forward * heading.sin();
+        estimate.heading = normalize(estimate.heading + turn);
+        estimate.travelled_mm += forward.abs();
+
+        let speed = |i: usize| wheels[i].velocity_mm_per_s as f64 * sign(i);
+        estimate.velocity_mm_per_s = (speed(0) + speed(1)) / 2.0;
+        estimate.yaw_rate = (speed(1) - speed(0)) / WHEEL_BASE_MM;
+        estimate.timestamp_ns = wheels[0].last_tick_ns.max(wheels[1].last_tick_ns);
+        *estimate
+    }
+}
+
+fn normalize(angle: f64) -> f64 {
+    let mut angle = angle % (2.0 * PI);
+    if angle > PI {
+        angle -= 2.0 * PI;
+    } else if angle < -PI {
+        angle += 2.0 * PI;
+    }
+    angle
+}
+
+/// The latest estimate for readers in other threads. One thread publishes, readers
+/// never block it and never wait for a lock, they retry while an update is in progress.
+pub struct SharedEstimate {
+    sequence: AtomicU32,
+    estimate: UnsafeCell<Estimate>,
+}
+
+unsafe impl Sync for SharedEstimate {}
+
+impl SharedEstimate {
+    pub fn new() -> Self {
+        SharedEstimate {
+            sequence: AtomicU32::new(0),
+            estimate: UnsafeCell::new(Estimate::default()),
+        }
+    }
+
+    /// Only ever called from one thread
+    pub fn publish(&self, estimate: Estimate) {
+        let sequence = self.sequence.load(Ordering::Relaxed);
+        self.sequence.store(sequence.wrapping_add(1), Ordering::Relaxed);
+        fence(Ordering::Release);
+        unsafe { std::ptr::write_volatile(self.estimate.get(), estimate) };
+        self.sequence.store(sequence.wrapping_add(2), Ordering::Release);
+    }
+
+    pub fn read(&self) -> Estimate {
+        loop {
+            let before = self.sequence.load(Ordering::Acquire);
+            if before & 1 != 0 {
+                std::hint::spin_loop();
+                continue;
+            }
+            let estimate = unsafe { std::ptr::read_volatile(self.estimate.get()) };
+            fence(Ordering::Acquire);
+            if self.sequence.load(Ordering::Relaxed) == before {
+                return estimate;
+            }
+        }
+    }
+}
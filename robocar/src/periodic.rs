@@ -0,0 +1,202 @@
+//! Periodic real-time tasks
+//!
+//! All tasks are declared up front in a `Runtime`, which hands out rate monotonic
+//! SCHED_FIFO priorities: the shorter the period, the higher the priority. A task sleeps
+//! until its next release with `clock_nanosleep(TIMER_ABSTIME)`, so its period does not
+//! drift by its own execution time. Deadlines are implicit (= period).
+
+use log::*;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+/// Counters of one task, readable while it runs
+#[derive(Default, Debug)]
+pub struct TaskStats {
+    pub name: &'static str,
+    pub releases: AtomicU64,
+    /// Jobs that finished after their deadline
+    pub deadline_misses: AtomicU64,
+    /// Releases skipped because a job took longer than a whole period
+    pub overruns: AtomicU64,
+    /// Longest time from release to the end of a job
+    pub max_response_ns: AtomicU64,
+}
+
+static STATS: Mutex<Vec<Arc<TaskStats>>> = Mutex::new(Vec::new());
+
+#[derive(Clone)]
+pub struct Runtime {
+    cpu: usize,
+    tasks: Vec<(&'static str, Duration)>,
+}
+
+impl Runtime {
+    /// `tasks` are name and period of every periodic task, all of them run on `cpu`
+    pub fn new(cpu: usize, tasks: &[(&'static str, Duration)]) -> Self {
+        Runtime {
+            cpu,
+            tasks: tasks.to_vec(),
+        }
+    }
+
+    /// Rate monotonic priority of `name`, the maximum for the shortest period
+    pub fn priority(&self, name: &str) -> i32 {
+        let period = self.period(name);
+        let mut shorter: Vec<Duration> = self
+            .tasks
+            .iter()
+            .map(|&(_, p)| p)
+            .filter(|&p| p < period)
+            .collect();
+        shorter.sort();
+        shorter.dedup();
+        let max = unsafe { libc::sched_get_priority_max(libc::SCHED_FIFO) };
+        max - shorter.len() as i32
+    }
+
+    fn period(&self, name: &str) -> Duration {
+        self.tasks
+            .iter()
+            .find(|&&(n, _)| n == name)
+            .map(|&(_, p)| p)
+            .expect(&format!("Task {} is not declared", name))
+    }
+
+    /// Turns the calling thread into the task `name`, the first release is now
+    pub fn start(&self, name: &'static str) -> Periodic {
+        setup_sched(self.cpu, self.priority(name));
+        let stats = Arc::new(TaskStats {
+            name,
+            ..Default::default()
+        });
+        STATS.lock().unwrap().push(stats.clone());
+        let period = self.period(name).as_nanos() as u64;
+        Periodic {
+            period,
+            release: now_ns(),
+            stats,
+        }
+    }
+}
+
+/// Handle of the calling thread's task, see `Runtime::start`
+pub struct Periodic {
+    period: u64,
+    release: u64,
+    stats: Arc<TaskStats>,
+}
+
+impl Periodic {
+    /// Ends the current job and sleeps until the next release.
+    /// After an overrun the missed releases are skipped instead of run back to back.
+    pub fn wait_next(&mut self) {
+        let release = self.end_job();
+        sleep_until(release);
+        self.start_job();
+    }
+
+    /// Ends the current job like `wait_next`, but leaves the sleeping to the caller.
+    /// Returns the next release in ns on CLOCK_MONOTONIC, always in the future.
+    pub fn end_job(&mut self) -> u64 {
+        let now = now_ns();
+        let response = now.saturating_sub(self.release);
+        self.stats.max_response_ns.fetch_max(response, Ordering::Relaxed);
+        if response > self.period {
+            self.stats.deadline_misses.fetch_add(1, Ordering::Relaxed);
+        }
+
+        self.release += self.period;
+        if self.release <= now {
+            let missed = (now - self.release) / self.period + 1;
+            self.stats.overruns.fetch_add(missed, Ordering::Relaxed);
+            self.release += missed * self.period;
+        }
+        self.release
+    }
+
+    /// Counts the release the caller waited for after `end_job`
+    pub fn start_job(&self) {
+        self.stats.releases.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn stats(&self) -> &TaskStats {
+        &self.stats
+    }
+}
+
+/// Writes the counters of tasks that missed deadlines to the error log
+pub fn report() {
+    if let Ok(stats) = STATS.try_lock() {
+        for task in stats.iter() {
+            let misses = task.deadline_misses.load(Ordering::Relaxed);
+            let overruns = task.overruns.load(Ordering::Relaxed);
+            if misses > 0 || overruns > 0 {
+                error!(
+                    "{}: {} of {} deadlines missed, {} releases overrun, max response {} us",
+                    task.name,
+                    misses,
+                    task.releases.load(Ordering::Relaxed),
+                    overruns,
+                    task.max_response_ns.load(Ordering::Relaxed) / 1000
+                );
+            }
+        }
+    }
+}
+
+pub fn setup_sched(cpu: usize, priority: i32) {
+    unsafe {
+        let params = libc::sched_param {
+            sched_priority: priority,
+        };
+        let _ = libc::sched_setscheduler(0, libc::SCHED_FIFO, &params);
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(cpu, &mut set);
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set);
+    }
+}
+
+/// For threads outside the real-time proof: SCHED_OTHER on every core except `rt_cpu`.
+/// New threads inherit policy and affinity of the thread that spawns them, usually a
+/// real-time task, so they have to call this first.
+pub fn setup_background(rt_cpu: usize) {
+    unsafe {
+        let params = libc::sched_param { sched_priority: 0 };
+        let _ = libc::sched_setscheduler(0, libc::SCHED_OTHER, &params);
+        let cpus = libc::sysconf(libc::_SC_NPROCESSORS_ONLN).max(1) as usize;
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        for cpu in (0..cpus).filter(|&cpu| cpu != rt_cpu || cpus == 1) {
+            libc::CPU_SET(cpu, &mut set);
+        }
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set);
+    }
+}
+
+pub fn now_ns() -> u64 {
+    let mut ts = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    unsafe {
+        libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts);
+    }
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// Absolute sleep on CLOCK_MONOTONIC, continues after signals
+pub fn sleep_until(time_ns: u64) {
+    let ts = libc::timespec {
+        tv_sec: (time_ns / 1_000_000_000) as libc::time_t,
+        tv_nsec: (time_ns % 1_000_000_000) as libc::c_long,
+    };
+    while unsafe {
+        libc::clock_nanosleep(
+            libc::CLOCK_MONOTONIC,
+            libc::TIMER_ABSTIME,
+            &ts,
+            std::ptr::null_mut(),
+        )
+    } == libc::EINTR
+    {}
+}
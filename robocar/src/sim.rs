@@ -0,0 +1,485 @@
+//! Simulated car: a differential drive model in a world of walls, tape lines and RFID
+//! tags. Time only advances through `advance()`, so a run takes as
+//! long as the computer needs and not as long as the car would drive.
+//!
+//! Coordinates are in mm, x points forward at heading 0, y to the left, angles in
+//! radians counterclockwise.
+
+use crate::car::{Car, CarState, Card, Lines, Sample, Wheel};
+use crate::odometry::{Estimate, Odometry};
+use std::cell::RefCell;
+use std::collections::VecDeque;
+use std::f64::consts::PI;
+use std::time::Duration;
+
+/// Integration step of the model
+const STEP_NS: u64 = 1_000_000;
+const WHEEL_BASE_MM: f64 = 130.0;
+/// The motors reach 63% of a new speed after this time
+const MOTOR_TIME_CONSTANT_S: f64 = 0.1;
+/// Below this PWM value the motors do not turn
+const MOTOR_DEADBAND_PERCENT: f64 = 20.0;
+const MOTOR_MM_PER_S_PER_PERCENT: f64 = 6.0;
+/// Same values as drivers/lightbarrier/lightbarrier.h and the ultrasonic module
+const UM_PER_TICK: u64 = 11_250;
+const STANDSTILL_NS: u64 = 500_000_000;
+const ULTRASONIC_PERIOD_NS: u64 = 20_000_000;
+const ULTRASONIC_MAX_MM: f64 = 3000.0;
+/// Speed controller of drivers/motor/motor.c with its default parameters
+const CONTROL_PERIOD_NS: u64 = 10_000_000;
+const KP: i64 = 50;
+const KI: i64 = 100;
+const KD: i64 = 0;
+const LINE_WIDTH_MM: f64 = 19.0;
+const TAG_RADIUS_MM: f64 = 40.0;
+
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct Point {
+    pub x: f64,
+    pub y: f64,
+}
+
+impl Point {
+    pub fn new(x: f64, y: f64) -> Self {
+        Point { x, y }
+    }
+
+    fn distance(self, other: Point) -> f64 {
+        ((self.x - other.x).powi(2) + (self.y - other.y).powi(2)).sqrt()
+    }
+}
+
+#[derive(Clone, Copy, Debug)]
+pub struct Segment {
+    pub a: Point,
+    pub b: Point,
+}
+
+impl Segment {
+    pub fn new(a: Point, b: Point) -> Self {
+        Segment { a, b }
+    }
+
+    fn distance(&self, p: Point) -> f64 {
+        let (dx, dy) = (self.b.x - self.a.x, self.b.y - self.a.y);
+        let length = dx * dx + dy * dy;
+        let t = if length == 0.0 {
+            0.0
+        } else {
+            (((p.x - self.a.x) * dx + (p.y - self.a.y) * dy) / length)
+                .max(0.0)
+                .min(1.0)
+        };
+        p.distance(Point::new(self.a.x + t * dx, self.a.y + t * dy))
+    }
+
+    /// Distance along the ray from `origin` in direction `angle` to this segment
+    fn ray(&self, origin: Point, angle: f64) -> Option<f64> {
+        let (rx, ry) = (angle.cos(), angle.sin());
+        let (sx, sy) = (self.b.x - self.a.x, self.b.y - self.a.y);
+        let denominator = rx * sy - ry * sx;
+        if denominator.abs() < 1e-12 {
+            return None;
+        }
+        let (qx, qy) = (self.a.x - origin.x, self.a.y - origin.y);
+        let t = (qx * sy - qy * sx) / denominator;
+        let u = (qx * ry - qy * rx) / denominator;
+        if t >= 0.0 && u >= 0.0 && u <= 1.0 {
+            Some(t)
+        } else {
+            None
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug)]
+pub struct Tag {
+    pub position: Point,
+    pub uid: [u8; 4],
+}
+
+/// Walls reflect the ultrasonic, lines are seen by the IR sensors, tags by the RFID reader
+#[derive(Clone, Debug, Default)]
+pub struct World {
+    pub walls: Vec<Segment>,
+    pub lines: Vec<Segment>,
+    pub tags: Vec<Tag>,
+}
+
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Pose {
+    pub position: Point,
+    pub heading: f64,
+}
+
+impl Pose {
+    /// Point at `forward`/`left` mm relative to the car
+    fn offset(&self, forward: f64, left: f64) -> Point {
+        let (sin, cos) = self.heading.sin_cos();
+        Point::new(
+            self.position.x + forward * cos - left * sin,
+            self.position.y + forward * sin + left * cos,
+        )
+    }
+}
+
+/// Where a sensor sits on the car, relative to the center between the wheels
+#[derive(Clone, Copy, Debug)]
+pub struct Mount {
+    pub forward: f64,
+    pub left: f64,
+    pub angle: f64,
+}
+
+/// Ultrasonic sensors left and right plus the IR line sensors from left to right
+#[derive(Clone, Copy, Debug)]
+pub struct Geometry {
+    pub ultrasonic: [Mount; 2],
+    pub lines: [Mount; 4],
+}
+
+impl Default for Geometry {
+    fn default() -> Self {
+        let ir = |left| Mount {
+            forward: 80.0,
+            left,
+            angle: 0.0,
+        };
+        Geometry {
+            ultrasonic: [
+                Mount {
+                    forward: 60.0,
+                    left: 50.0,
+                    angle: PI / 6.0,
+                },
+                Mount {
+                    forward: 60.0,
+                    left: -50.0,
+                    angle: -PI / 6.0,
+                },
+            ],
+            lines: [ir(30.0), ir(10.0), ir(-10.0), ir(-30.0)],
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+enum Command {
+    Direct(i32),
+    Target(i32),
+}
+
+/// One motor with its wheel, lightbarrier and the kernel speed controller
+#[derive(Clone, Copy, Debug)]
+struct Motor {
+    command: Command,
+    /// Sign of the last nonzero command, what the odometry assumes
+    direction: i32,
+    /// Duty cycle the motor currently gets, in permille
+    output: i32,
+    speed_mm_per_s: f64,
+    travelled_um: f64,
+    wheel: Wheel,
+    integral: i64,
+    previous_error: i64,
+}
+
+impl Motor {
+    fn new() -> Self {
+        Motor {
+            command: Command::Direct(0),
+            direction: 1,
+            output: 0,
+            speed_mm_per_s: 0.0,
+            travelled_um: 0.0,
+            wheel: Wheel::default(),
+            integral: 0,
+            previous_error: 0,
+        }
+    }
+
+    fn set(&mut self, command: Command) {
+        let (Command::Direct(value) | Command::Target(value)) = command;
+        if value != 0 {
+            self.direction = value.signum();
+        }
+        match command {
+            Command::Direct(speed) => self.output = speed.max(-100).min(100) * 10,
+            Command::Target(_) => {
+                if self.command != command {
+                    self.integral = 0;
+                    self.previous_error = 0;
+                }
+            }
+        }
+        self.command = command;
+    }
+
+    /// `lightbarrier_velocity()` of the lightbarrier header
+    fn measured_speed(&self, now: u64) -> i64 {
+        let wheel = &self.wheel;
+        if wheel.period_ns == 0 {
+            return 0;
+        }
+        let since = now.saturating_sub(wheel.last_tick_ns);
+        if since > STANDSTILL_NS {
+            return 0;
+        }
+        if since <= wheel.period_ns {
+            return wheel.velocity_mm_per_s as i64;
+        }
+        let bound = UM_PER_TICK * 1_000_000 / since;
+        (wheel.velocity_mm_per_s as u64).min(bound) as i64
+    }
+
+    /// `control_step()` of the motor driver
+    fn control_step(&mut self, now: u64) {
+        let target = match self.command {
+            Command::Target(target) => target as i64,
+            Command::Direct(_) => return,
+        };
+        if target == 0 {
+            self.output = 0;
+            return;
+        }
+        let error = target.abs() - self.measured_speed(now);
+        let period_ms = (CONTROL_PERIOD_NS / 1_000_000) as i64;
+        self.integral += error * period_ms;
+        let limit = 50_000 * 1000 / KI;
+        self.integral = self.integral.max(-limit).min(limit);
+        let feed_forward = (target.abs() / 10 + 50) * 1000;
+        let output = feed_forward
+            + KP * error
+            + KI * self.integral / 1000
+            + KD * (error - self.previous_error) * 1000 / period_ms;
+        self.previous_error = error;
+        self.output = (target.signum() * output.max(0).min(100_000) / 100) as i32;
+    }
+
+    fn advance(&mut self, now: u64, dt: f64) {
+        let percent = self.output as f64 / 10.0;
+        let steady = percent.signum()
+            * (percent.abs() - MOTOR_DEADBAND_PERCENT).max(0.0)
+            * MOTOR_MM_PER_S_PER_PERCENT;
+        self.speed_mm_per_s +=
+            (steady - self.speed_mm_per_s) * (dt / MOTOR_TIME_CONSTANT_S).min(1.0);
+
+        // The lightbarrier counts slots regardless of the direction
+        self.travelled_um += self.speed_mm_per_s.abs() * dt * 1000.0;
+        while self.travelled_um >= UM_PER_TICK as f64 {
+            self.travelled_um -= UM_PER_TICK as f64;
+            self.tick(now);
+        }
+    }
+
+    /// `record_period()` of the lightbarrier driver
+    fn tick(&mut self, now: u64) {
+        let wheel = &mut self.wheel;
+        wheel.ticks += 1;
+        if wheel.last_tick_ns != 0 {
+            let period = now - wheel.last_tick_ns;
+            let velocity = (UM_PER_TICK * 1_000_000 / period.max(1)) as u32;
+            wheel.velocity_mm_per_s = if wheel.period_ns == 0 {
+                velocity
+            } else {
+                (3 * wheel.velocity_mm_per_s + velocity) / 4
+            };
+            wheel.period_ns = period;
+        }
+        wheel.last_tick_ns = now;
+    }
+}
+
+struct State {
+    now_ns: u64,
+    pose: Pose,
+    motors: [Motor; 2],
+    odometry: Odometry,
+    samples: [Sample; 2],
+    sequence: u32,
+    next_ultrasonic_ns: u64,
+    next_control_ns: u64,
+    on_tag: Vec<bool>,
+    cards: VecDeque<Card>,
+}
+
+pub struct Simulation {
+    world: World,
+    geometry: Geometry,
+    state: RefCell<State>,
+}
+
+impl Simulation {
+    pub fn new(world: World, start: Pose) -> Self {
+        let tags = world.tags.len();
+        Simulation {
+            world,
+            geometry: Geometry::default(),
+            state: RefCell::new(State {
+                // Timestamps of 0 mean "never" in the drivers
+                now_ns: 1,
+                pose: start,
+                motors: [Motor::new(), Motor::new()],
+                odometry: Odometry::new(),
+                samples: [Sample::default(); 2],
+                sequence: 0,
+                next_ultrasonic_ns: 0,
+                next_control_ns: 0,
+                on_tag: vec![false; tags],
+                cards: VecDeque::new(),
+            }),
+        }
+    }
+
+    pub fn with_geometry(mut self, geometry: Geometry) -> Self {
+        self.geometry = geometry;
+        self
+    }
+
+    pub fn now_ns(&self) -> u64 {
+        self.state.borrow().now_ns
+    }
+
+    pub fn pose(&self) -> Pose {
+        self.state.borrow().pose
+    }
+
+    /// Actual wheel speeds in mm/s, not what the lightbarriers measure
+    pub fn wheel_speeds(&self) -> [f64; 2] {
+        let state = self.state.borrow();
+        [
+            state.motors[0].speed_mm_per_s,
+            state.motors[1].speed_mm_per_s,
+        ]
+    }
+
+    /// Next card that entered the reader's field
+    pub fn take_card(&self) -> Option<Card> {
+        self.state.borrow_mut().cards.pop_front()
+    }
+
+    /// Runs the model for `duration`
+    pub fn advance(&self, duration: Duration) {
+        let mut state = self.state.borrow_mut();
+        let end = state.now_ns + duration.as_nanos() as u64;
+        while state.now_ns < end {
+            self.step(&mut state);
+        }
+    }
+
+    fn step(&self, state: &mut State) {
+        let now = state.now_ns;
+        if now >= state.next_control_ns {
+            for motor in state.motors.iter_mut() {
+                motor.control_step(now);
+            }
+            state.next_control_ns = now + CONTROL_PERIOD_NS;
+        }
+        if now >= state.next_ultrasonic_ns {
+            self.measure(state);
+            state.next_ultrasonic_ns = now + ULTRASONIC_PERIOD_NS;
+        }
+
+        let dt = STEP_NS as f64 / 1e9;
+        for motor in state.motors.iter_mut() {
+            motor.advance(now, dt);
+        }
+        let [left, right] = state.motors;
+        state
+            .odometry
+            .update(&[left.wheel, right.wheel], [left.direction, right.direction]);
+        let (left, right) = (
+            state.motors[0].speed_mm_per_s,
+            state.motors[1].speed_mm_per_s,
+        );
+        let speed = (left + right) / 2.0;
+        let turn = (right - left) / WHEEL_BASE_MM;
+        let pose = &mut state.pose;
+        pose.position.x += speed * pose.heading.cos() * dt;
+        pose.position.y += speed * pose.heading.sin() * dt;
+        pose.heading += turn * dt;
+
+        let reader = state.pose.position;
+        for (index, tag) in self.world.tags.iter().enumerate() {
+            let inside = reader.distance(tag.position) <= TAG_RADIUS_MM;
+            if inside && !state.on_tag[index] {
+                state.cards.push_back(Card::new(now, &tag.uid));
+            }
+            state.on_tag[index] = inside;
+        }
+        state.now_ns += STEP_NS;
+    }
+
+    fn measure(&self, state: &mut State) {
+        for (index, mount) in self.geometry.ultrasonic.iter().enumerate() {
+            let origin = state.pose.offset(mount.forward, mount.left);
+            let angle = state.pose.heading + mount.angle;
+            let distance = self
+                .world
+                .walls
+                .iter()
+                .filter_map(|wall| wall.ray(origin, angle))
+                .fold(std::f64::INFINITY, f64::min);
+            state.sequence = state.sequence.wrapping_add(1);
+            let distance = if distance <= ULTRASONIC_MAX_MM {
+                Some(distance as u32)
+            } else {
+                None
+            };
+            state.samples[index] = Sample::new(state.now_ns, state.sequence, distance);
+        }
+    }
+
+    fn sees_line(&self, pose: &Pose, mount: &Mount) -> bool {
+        let point = pose.offset(mount.forward, mount.left);
+        self.world
+            .lines
+            .iter()
+            .any(|line| line.distance(point) <= LINE_WIDTH_MM / 2.0)
+    }
+}
+
+impl Car for Simulation {
+    fn read(&self) -> CarState {
+        let state = self.state.borrow();
+        CarState {
+            ultrasonic: state.samples,
+            wheels: [state.motors[0].wheel, state.motors[1].wheel],
+        }
+    }
+
+    fn lines(&self) -> Lines {
+        let pose = self.pose();
+        let sensors = &self.geometry.lines;
+        Lines {
+            left: self.sees_line(&pose, &sensors[0]),
+            middle_left: self.sees_line(&pose, &sensors[1]),
+            middle_right: self.sees_line(&pose, &sensors[2]),
+            right: self.sees_line(&pose, &sensors[3]),
+        }
+    }
+
+    fn odometry(&self) -> Estimate {
+        self.state.borrow().odometry.estimate()
+    }
+
+    fn set_direct_speed(&self, left: i32, right: i32) {
+        let mut state = self.state.borrow_mut();
+        state.motors[0].set(Command::Direct(left));
+        state.motors[1].set(Command::Direct(right));
+    }
+
+    fn set_direct_speed_left(&self, speed: i32) {
+        self.state.borrow_mut().motors[0].set(Command::Direct(speed));
+    }
+
+    fn set_target_and_estimate(&self, left: i32, right: i32) {
+        let mut state = self.state.borrow_mut();
+        state.motors[0].set(Command::Target(left));
+        state.motors[1].set(Command::Target(right));
+    }
+
+    fn now_ns(&self) -> u64 {
+        Simulation::now_ns(self)
+    }
+}